@@ -0,0 +1,267 @@
+// Headless batch renderer: loads a model, renders it from a list of camera
+// positions or a turntable and writes one image per frame plus a timing log.
+// Needs only QtCore and QtGui, so it runs on machines without a display.
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QDir>
+#include <QRegExp>
+#include <QTextStream>
+
+#include <cstdio>
+
+#include "Loader/ModelLoader.h"
+#include "Render/ModelRender.h"
+
+using SpanningScanline::ModelLoader;
+using SpanningScanline::ModelRender;
+
+namespace {
+	// Same orbit as the interactive viewer: rotate around y, then tilt around x
+	QVector3D orbitCameraPos(float horizontalAngle, float verticalAngle, float distance)
+	{
+		QMatrix4x4 rot;
+		rot.rotate(horizontalAngle, QVector3D(0.f, 1.f, 0.f));
+		rot.rotate(verticalAngle, QVector3D(1.f, 0.f, 0.f));
+
+		return (rot * QVector4D(0, 0, distance, 1)).toVector3D();
+	}
+
+	// One camera position per line, "x y z". Empty lines and lines starting
+	// with '#' are skipped.
+	bool readPoses(const QString &fileName, QVector<QVector3D> &poses)
+	{
+		QFile file(fileName);
+		if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+			qWarning("Cannot open pose file %s", qPrintable(fileName));
+			return false;
+		}
+
+		QTextStream in(&file);
+		int lineNumber = 0;
+		while (!in.atEnd()) {
+			const QString line = in.readLine().trimmed();
+			lineNumber++;
+
+			if (line.isEmpty() || line.startsWith('#')) {
+				continue;
+			}
+
+			// Empty fields are dropped by hand: QString::SkipEmptyParts is
+			// deprecated in Qt 5.15 and Qt::SkipEmptyParts needs 5.14
+			QStringList fields = line.split(QRegExp("[\\s,]+"));
+			fields.removeAll(QString());
+			bool ok = fields.size() == 3;
+			QVector3D pos;
+			for (int i = 0; ok && i < 3; i++) {
+				pos[i] = fields[i].toFloat(&ok);
+			}
+
+			if (!ok) {
+				qWarning("%s:%d: expected \"x y z\"", qPrintable(fileName), lineNumber);
+				return false;
+			}
+
+			poses.push_back(pos);
+		}
+
+		return true;
+	}
+
+	bool parseSize(const QString &value, int &width, int &height)
+	{
+		const QStringList fields = value.split('x');
+		if (fields.size() != 2) {
+			return false;
+		}
+
+		bool okWidth, okHeight;
+		width = fields[0].toInt(&okWidth);
+		height = fields[1].toInt(&okHeight);
+
+		return okWidth && okHeight && width > 0 && height > 0;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	QCoreApplication app(argc, argv);
+	QCoreApplication::setApplicationName("SpanningScanlineBatch");
+
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Renders a model offline with the spanning scanline renderer.");
+	parser.addHelpOption();
+	parser.addPositionalArgument("model", "Model file, any format assimp can import.");
+
+	QCommandLineOption sizeOption(QStringList() << "s" << "size",
+		"Output resolution.", "WxH", "800x600");
+	QCommandLineOption outputOption(QStringList() << "o" << "output",
+		"Output directory, created if missing.", "dir", ".");
+	QCommandLineOption formatOption("format",
+		"Image format, any format QImageWriter supports.", "ext", "png");
+	QCommandLineOption posesOption("poses",
+		"File with one camera position \"x y z\" per line. The camera looks at the origin.", "file");
+	QCommandLineOption turntableOption("turntable",
+		"Render this many frames evenly spaced around the y axis.", "frames", "1");
+	QCommandLineOption distanceOption("distance",
+		"Turntable camera distance.", "distance", "5");
+	QCommandLineOption elevationOption("elevation",
+		"Turntable camera elevation in degrees.", "degrees", "0");
+	QCommandLineOption threadsOption("threads",
+		"Render threads, 0 uses every core.", "count", "0");
+	QCommandLineOption unitOption("unit",
+		"Scale and center the model to the unit cube before rendering.");
+	QCommandLineOption shadingOption("shading",
+		"flat, gouraud or phong.", "mode", "flat");
+	QCommandLineOption antiAliasOption("antialias",
+		"Blend the pixels along polygon edges by their exact coverage.");
+	QCommandLineOption lodErrorOption("lod-error",
+		"Draw simplified meshes while their error stays below this many pixels, 0 always draws full detail.", "pixels", "1");
+	QCommandLineOption optimizeOrderOption("optimize-order",
+		"Reorder triangles and vertices of every mesh for locality after importing.");
+	QCommandLineOption noCacheOption("no-cache",
+		"Always import the model with assimp, without reading or writing the model cache.");
+
+	parser.addOptions(QList<QCommandLineOption>() << sizeOption << outputOption << formatOption
+		<< posesOption << turntableOption << distanceOption << elevationOption << threadsOption << unitOption
+		<< shadingOption << antiAliasOption << lodErrorOption << optimizeOrderOption << noCacheOption);
+	parser.process(app);
+
+	const QStringList args = parser.positionalArguments();
+	if (args.size() != 1) {
+		parser.showHelp(1);
+	}
+
+	int width, height;
+	if (!parseSize(parser.value(sizeOption), width, height)) {
+		qWarning("Invalid size %s, expected WxH", qPrintable(parser.value(sizeOption)));
+		return 1;
+	}
+
+	const QString shading = parser.value(shadingOption);
+	ModelRender::ShadingMode shadingMode;
+	if (shading == "flat") {
+		shadingMode = ModelRender::ShadeFlat;
+	}
+	else if (shading == "gouraud") {
+		shadingMode = ModelRender::ShadeGouraud;
+	}
+	else if (shading == "phong") {
+		shadingMode = ModelRender::ShadePhong;
+	}
+	else {
+		qWarning("Invalid shading %s, expected flat, gouraud or phong", qPrintable(shading));
+		return 1;
+	}
+
+	bool lodErrorOk;
+	const float lodError = parser.value(lodErrorOption).toFloat(&lodErrorOk);
+	if (!lodErrorOk || lodError < 0.f) {
+		qWarning("Invalid level of detail error %s", qPrintable(parser.value(lodErrorOption)));
+		return 1;
+	}
+
+	QVector<QVector3D> poses;
+	if (parser.isSet(posesOption)) {
+		if (!readPoses(parser.value(posesOption), poses)) {
+			return 1;
+		}
+	}
+	else {
+		const int frames = qMax(1, parser.value(turntableOption).toInt());
+		const float distance = parser.value(distanceOption).toFloat();
+		const float elevation = parser.value(elevationOption).toFloat();
+
+		for (int i = 0; i < frames; i++) {
+			poses.push_back(orbitCameraPos(360.f * i / frames, -elevation, distance));
+		}
+	}
+
+	if (poses.isEmpty()) {
+		qWarning("No camera poses to render");
+		return 1;
+	}
+
+	QDir outputDir(parser.value(outputOption));
+	if (!outputDir.mkpath(".")) {
+		qWarning("Cannot create output directory %s", qPrintable(outputDir.path()));
+		return 1;
+	}
+
+	ModelLoader loader(parser.isSet(unitOption));
+	loader.setImportProfile(ModelLoader::ImportRenderOnly);
+	loader.setOptimizeVertexOrder(parser.isSet(optimizeOrderOption));
+	loader.setBuildLevelsOfDetail(lodError > 0.f);
+	if (parser.isSet(noCacheOption)) {
+		loader.setCacheDirectory(QString());
+	}
+	QElapsedTimer timer;
+	timer.start();
+
+	if (!loader.load(args[0], ModelLoader::PathType::AbsolutePath)) {
+		qWarning("Cannot load model %s", qPrintable(args[0]));
+		return 1;
+	}
+
+	const qint64 loadTime = timer.elapsed();
+
+	QVector<float> *vertices;
+	QVector<float> *normals;
+	QVector<unsigned int> *indices;
+	loader.getBufferData(&vertices, &normals, &indices);
+
+	QVector<QVector<float> > *textureUV;
+	loader.getTextureData(&textureUV, 0, 0);
+
+	ModelRender render(qRgb(0, 0, 0));
+	render.setBufferData(*vertices, *normals, *indices);
+	render.setLevelIndices(loader.getLevelIndices());
+	if (loader.numUVChannels() > 0 && loader.numUVComponents(0) == 2) {
+		render.setTextureCoordinates(textureUV->first());
+	}
+	render.setNodeData(loader.getNodeData());
+	render.setWindowSize(width, height);
+	render.setThreadCount(parser.value(threadsOption).toInt());
+	render.setShadingMode(shadingMode);
+	render.setAntiAliasing(parser.isSet(antiAliasOption));
+	render.setLevelOfDetailError(lodError);
+
+	QFile timingFile(outputDir.filePath("timing.csv"));
+	if (!timingFile.open(QIODevice::WriteOnly | QIODevice::Text)) {
+		qWarning("Cannot write %s", qPrintable(timingFile.fileName()));
+		return 1;
+	}
+
+	QTextStream timing(&timingFile);
+	timing << "frame,image,camera_x,camera_y,camera_z,render_ms\n";
+
+	const QString format = parser.value(formatOption);
+	qint64 totalRenderTime = 0;
+	bool failed = false;
+
+	for (int i = 0; i < poses.size(); i++) {
+		render.setCameraPos(poses[i]);
+
+		timer.restart();
+		render.render();
+		const qint64 renderTime = timer.elapsed();
+		totalRenderTime += renderTime;
+
+		const QString imageName = QString("frame_%1.%2").arg(i, 4, 10, QChar('0')).arg(format);
+		if (!render.getRenderResult().save(outputDir.filePath(imageName))) {
+			qWarning("Cannot write %s", qPrintable(outputDir.filePath(imageName)));
+			failed = true;
+		}
+
+		timing << i << ',' << imageName << ','
+			<< poses[i].x() << ',' << poses[i].y() << ',' << poses[i].z() << ','
+			<< renderTime << '\n';
+	}
+
+	printf("Loaded in %lld ms, rendered %d frames in %lld ms\n",
+		(long long)loadTime, poses.size(), (long long)totalRenderTime);
+
+	return failed ? 1 : 0;
+}
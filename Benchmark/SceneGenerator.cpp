@@ -0,0 +1,167 @@
+#include "SceneGenerator.h"
+#include "Render/ModelRender.h"
+
+#include <cmath>
+
+using SpanningScanline::SyntheticScene;
+using SpanningScanline::SceneGenerator;
+
+namespace {
+	const float kPi = 3.14159265f;
+
+	// Half the size of the box scenes are generated in. The camera sees about
+	// +-3.5 vertically at the origin, so the box stays on screen.
+	const float kHalfExtent = 3.f;
+	const float kHalfDepth = 1.f;
+}
+
+SceneGenerator::SceneGenerator(unsigned int seed) :
+	m_state(seed ? seed : 1)
+{
+}
+
+float SceneGenerator::random()
+{
+	// xorshift32, std distributions differ between standard libraries
+	m_state ^= m_state << 13;
+	m_state ^= m_state >> 17;
+	m_state ^= m_state << 5;
+
+	return (m_state >> 8) * (1.f / 16777216.f);
+}
+
+float SceneGenerator::random(float min, float max)
+{
+	return min + (max - min) * random();
+}
+
+void SceneGenerator::addTriangle(SyntheticScene &scene, const QVector3D &a, const QVector3D &b, const QVector3D &c)
+{
+	const QVector3D normal = QVector3D::crossProduct(b - a, c - a).normalized();
+	const unsigned int first = scene.vertices.size() / 3;
+
+	for (const QVector3D &v : { a, b, c }) {
+		scene.vertices << v.x() << v.y() << v.z();
+		scene.normals << normal.x() << normal.y() << normal.z();
+	}
+
+	scene.indices << first << first + 1 << first + 2;
+}
+
+SyntheticScene SceneGenerator::sphere(int stacks, int slices)
+{
+	SyntheticScene scene;
+	scene.name = QString("sphere_%1").arg(2 * stacks * slices);
+	scene.cullMode = ModelRender::CullAll;
+
+	const float radius = 2.f;
+
+	for (int i = 0; i <= stacks; i++) {
+		const float theta = kPi * i / stacks;
+
+		for (int j = 0; j <= slices; j++) {
+			const float phi = 2.f * kPi * j / slices;
+			const QVector3D n(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+
+			scene.vertices << radius * n.x() << radius * n.y() << radius * n.z();
+			scene.normals << n.x() << n.y() << n.z();
+		}
+	}
+
+	// Counter-clockwise seen from outside. The triangles at the poles are
+	// degenerate, like in most tessellated spheres.
+	for (int i = 0; i < stacks; i++) {
+		for (int j = 0; j < slices; j++) {
+			const unsigned int a = i * (slices + 1) + j;
+			const unsigned int b = a + slices + 1;
+
+			scene.indices << a << a + 1 << b;
+			scene.indices << b << a + 1 << b + 1;
+		}
+	}
+
+	return scene;
+}
+
+SyntheticScene SceneGenerator::triangleSoup(int triangleCount, float depthComplexity)
+{
+	SyntheticScene scene;
+	scene.name = QString("soup_%1_dc%2").arg(triangleCount).arg(depthComplexity);
+	scene.cullMode = ModelRender::CullAll;
+
+	const float boxArea = 4.f * kHalfExtent * kHalfExtent;
+	const float triangleArea = boxArea * depthComplexity / triangleCount;
+
+	// Equilateral triangles, side length from the area
+	const float radius = std::sqrt(4.f * triangleArea / std::sqrt(3.f)) / std::sqrt(3.f);
+
+	for (int i = 0; i < triangleCount; i++) {
+		const QVector3D center(random(-kHalfExtent, kHalfExtent), random(-kHalfExtent, kHalfExtent), random(-kHalfDepth, kHalfDepth));
+		const float angle = random(0.f, 2.f * kPi);
+
+		QVector3D v[3];
+		for (int k = 0; k < 3; k++) {
+			const float a = angle + k * 2.f * kPi / 3.f;
+			v[k] = center + radius * QVector3D(std::cos(a), std::sin(a), 0.f);
+		}
+
+		addTriangle(scene, v[0], v[1], v[2]);
+	}
+
+	return scene;
+}
+
+SyntheticScene SceneGenerator::slivers(int triangleCount)
+{
+	SyntheticScene scene;
+	scene.name = QString("slivers_%1").arg(triangleCount);
+	scene.cullMode = ModelRender::CullAll;
+
+	for (int i = 0; i < triangleCount; i++) {
+		const QVector3D center(random(-kHalfExtent, kHalfExtent) * 0.5f, random(-kHalfExtent, kHalfExtent) * 0.5f, random(-kHalfDepth, kHalfDepth));
+		const float angle = random(0.f, 2.f * kPi);
+		const float length = random(0.5f, 1.f) * kHalfExtent;
+		const float width = random(0.002f, 0.02f);
+
+		const QVector3D along(std::cos(angle), std::sin(angle), 0.f);
+		const QVector3D across(-along.y(), along.x(), 0.f);
+
+		addTriangle(scene, center - length * along, center + length * along, center + width * across);
+	}
+
+	return scene;
+}
+
+SyntheticScene SceneGenerator::interpenetrating(int triangleCount)
+{
+	SyntheticScene scene;
+	scene.name = QString("interpenetrating_%1").arg(triangleCount);
+	scene.cullMode = ModelRender::CullAll & ~ModelRender::CullBackFace;
+
+	const float radius = kHalfExtent * 0.6f;
+
+	for (int i = 0; i < triangleCount; i++) {
+		// Random plane through a point near the origin
+		const QVector3D center(random(-0.5f, 0.5f), random(-0.5f, 0.5f), random(-0.5f, 0.5f));
+		QVector3D normal(random(-1.f, 1.f), random(-1.f, 1.f), random(-1.f, 1.f));
+		if (normal.lengthSquared() < 1e-4f) {
+			normal = QVector3D(0.f, 0.f, 1.f);
+		}
+		normal.normalize();
+
+		const QVector3D helper = std::fabs(normal.x()) < 0.9f ? QVector3D(1.f, 0.f, 0.f) : QVector3D(0.f, 1.f, 0.f);
+		const QVector3D u = QVector3D::crossProduct(normal, helper).normalized();
+		const QVector3D w = QVector3D::crossProduct(normal, u);
+		const float angle = random(0.f, 2.f * kPi);
+
+		QVector3D v[3];
+		for (int k = 0; k < 3; k++) {
+			const float a = angle + k * 2.f * kPi / 3.f;
+			v[k] = center + radius * (std::cos(a) * u + std::sin(a) * w);
+		}
+
+		addTriangle(scene, v[0], v[1], v[2]);
+	}
+
+	return scene;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <QVector>
+#include <QVector3D>
+#include <QString>
+
+namespace SpanningScanline {
+	// A procedurally generated scene, laid out like the buffers of ModelLoader
+	struct SyntheticScene {
+		QString name;
+
+		QVector<float> vertices;
+		QVector<float> normals;
+		QVector<unsigned int> indices;
+
+		int cullMode;	// ModelRender::CullMode flags to render the scene with
+
+		int triangleCount() const { return indices.size() / 3; }
+	};
+
+	// Every scene fits the view of a camera at cameraPos() looking at the
+	// origin. The same seed always generates the same scene, on every platform.
+	class SceneGenerator
+	{
+	public:
+		SceneGenerator(unsigned int seed = 1);
+
+		static QVector3D cameraPos() { return QVector3D(0.f, 0.f, 5.f); }
+
+		// Closed sphere of radius 2, 2 * stacks * slices triangles
+		SyntheticScene sphere(int stacks, int slices);
+
+		// Camera facing triangles scattered through a box. Their total area is
+		// depthComplexity times the area of the box's front face, so that is
+		// how many triangles an average pixel of the box is covered by.
+		SyntheticScene triangleSoup(int triangleCount, float depthComplexity);
+
+		// Long, very thin triangles in every direction, the worst case for
+		// the side table and the active side list
+		SyntheticScene slivers(int triangleCount);
+
+		// Large triangles through the middle of the box at random orientations,
+		// intersecting each other many times. Rendered without back-face culling.
+		SyntheticScene interpenetrating(int triangleCount);
+
+	private:
+		float random();								// In [0, 1)
+		float random(float min, float max);
+		void addTriangle(SyntheticScene &scene, const QVector3D &a, const QVector3D &b, const QVector3D &c);
+
+		unsigned int m_state;
+	};
+}
@@ -0,0 +1,205 @@
+// Rendering benchmark: renders procedurally generated scenes at several
+// resolutions and writes the per-stage timings of ModelRender::render() as
+// CSV, one row per scene and resolution. Scenes are generated from a fixed
+// seed, so runs on different machines or commits are comparable.
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QFile>
+#include <QTextStream>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#include "Render/ModelRender.h"
+#include "SceneGenerator.h"
+
+using SpanningScanline::ModelRender;
+using SpanningScanline::RenderStats;
+using SpanningScanline::SceneGenerator;
+using SpanningScanline::SyntheticScene;
+
+namespace {
+	struct Resolution {
+		int width;
+		int height;
+	};
+
+	double median(QVector<double> values)
+	{
+		std::sort(values.begin(), values.end());
+
+		const int n = values.size();
+		return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) * 0.5;
+	}
+
+	QVector<SyntheticScene> generateScenes(bool quick)
+	{
+		SceneGenerator generator;
+		QVector<SyntheticScene> scenes;
+
+		scenes << generator.sphere(16, 32);
+		scenes << generator.sphere(50, 100);
+		scenes << generator.sphere(160, 320);
+		if (!quick) {
+			scenes << generator.sphere(500, 1000);
+		}
+
+		const int soupSize = quick ? 5000 : 20000;
+		scenes << generator.triangleSoup(soupSize, 1.f);
+		scenes << generator.triangleSoup(soupSize, 4.f);
+		scenes << generator.triangleSoup(soupSize, 16.f);
+
+		scenes << generator.slivers(quick ? 5000 : 20000);
+
+		scenes << generator.interpenetrating(100);
+		scenes << generator.interpenetrating(quick ? 500 : 2000);
+
+		return scenes;
+	}
+
+	bool parseResolutions(const QString &value, QVector<Resolution> &resolutions)
+	{
+		// Empty entries are dropped by hand: QString::SkipEmptyParts is
+		// deprecated in Qt 5.15 and Qt::SkipEmptyParts needs 5.14
+		QStringList sizes = value.split(',');
+		sizes.removeAll(QString());
+
+		for (const QString &size : sizes) {
+			const QStringList fields = size.split('x');
+			if (fields.size() != 2) {
+				return false;
+			}
+
+			bool okWidth, okHeight;
+			Resolution r;
+			r.width = fields[0].toInt(&okWidth);
+			r.height = fields[1].toInt(&okHeight);
+
+			if (!okWidth || !okHeight || r.width <= 0 || r.height <= 0) {
+				return false;
+			}
+
+			resolutions.push_back(r);
+		}
+
+		return !resolutions.isEmpty();
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	QCoreApplication app(argc, argv);
+	QCoreApplication::setApplicationName("SpanningScanlineBenchmark");
+
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Times ModelRender::render() on generated scenes.");
+	parser.addHelpOption();
+
+	QCommandLineOption outputOption(QStringList() << "o" << "output",
+		"Write the CSV results to this file instead of stdout.", "file");
+	QCommandLineOption sizesOption("sizes",
+		"Comma separated resolutions.", "WxH,...", "320x240,800x600,1920x1080");
+	QCommandLineOption runsOption("runs",
+		"Timed renders per scene and resolution, after one warm-up render.", "count", "5");
+	QCommandLineOption threadsOption("threads",
+		"Render threads, 0 uses every core.", "count", "0");
+	QCommandLineOption filterOption("filter",
+		"Only run scenes whose name contains this text.", "text");
+	QCommandLineOption quickOption("quick",
+		"Skip the largest scenes.");
+	QCommandLineOption orbitOption("orbit",
+		"Turn the camera by this many degrees before each render, with temporal coherence on.", "degrees");
+
+	parser.addOptions(QList<QCommandLineOption>() << outputOption << sizesOption << runsOption
+		<< threadsOption << filterOption << quickOption << orbitOption);
+	parser.process(app);
+
+	QVector<Resolution> resolutions;
+	if (!parseResolutions(parser.value(sizesOption), resolutions)) {
+		qWarning("Invalid sizes %s, expected WxH,...", qPrintable(parser.value(sizesOption)));
+		return 1;
+	}
+
+	const int runs = qMax(1, parser.value(runsOption).toInt());
+	const int threads = qMax(0, parser.value(threadsOption).toInt());
+	const bool orbit = parser.isSet(orbitOption);
+	const float orbitStep = parser.value(orbitOption).toFloat() * 3.14159265f / 180.f;
+
+	QFile outputFile;
+	if (parser.isSet(outputOption)) {
+		outputFile.setFileName(parser.value(outputOption));
+		if (!outputFile.open(QIODevice::WriteOnly | QIODevice::Text)) {
+			qWarning("Cannot write %s", qPrintable(outputFile.fileName()));
+			return 1;
+		}
+	}
+	else {
+		outputFile.open(stdout, QIODevice::WriteOnly | QIODevice::Text);
+	}
+
+	QTextStream out(&outputFile);
+	out << "scene,triangles,width,height,threads,runs,"
+		"setup_ms,side_table_ms,scan_ms,total_ms,min_total_ms,"
+		"submitted_polygons,culled_back_face,culled_near_far,culled_left_right,rejected_polygons,inserted_polygons,"
+		"sides,peak_active_sides,active_side_swaps,spans,resolved_spans,depth_evaluations,"
+		"coherent_sort_rows,fallback_sort_rows,sort_work_saved\n";
+
+	const QVector<SyntheticScene> scenes = generateScenes(parser.isSet(quickOption));
+
+	for (const SyntheticScene &scene : scenes) {
+		if (parser.isSet(filterOption) && !scene.name.contains(parser.value(filterOption))) {
+			continue;
+		}
+
+		ModelRender render(qRgb(0, 0, 0));
+		render.setBufferData(scene.vertices, scene.normals, scene.indices);
+		render.setCullMode(scene.cullMode);
+		render.setThreadCount(threads);
+		render.setStatsEnabled(true);
+		render.setTemporalCoherence(orbit);
+
+		for (const Resolution &resolution : resolutions) {
+			render.setWindowSize(resolution.width, resolution.height);
+			render.setCameraPos(SceneGenerator::cameraPos());
+			render.render();	// warm-up, sizes every buffer
+
+			QVector<double> setup, sideTable, scan, total;
+			for (int i = 0; i < runs; i++) {
+				if (orbit) {
+					const float angle = (i + 1) * orbitStep;
+					const float distance = SceneGenerator::cameraPos().length();
+					render.setCameraPos(QVector3D(distance * std::sin(angle), 0.f, distance * std::cos(angle)));
+				}
+				render.render();
+
+				const RenderStats &stats = render.getRenderStats();
+				setup << stats.setupTime;
+				sideTable << stats.sideTableTime;
+				scan << stats.scanTime;
+				total << stats.setupTime + stats.sideTableTime + stats.scanTime;
+			}
+
+			// Counters do not change between runs of the same scene, unless
+			// orbiting, then they are the last run's
+			const RenderStats &stats = render.getRenderStats();
+
+			out << scene.name << ',' << scene.triangleCount() << ','
+				<< resolution.width << ',' << resolution.height << ',' << threads << ',' << runs << ','
+				<< median(setup) << ',' << median(sideTable) << ',' << median(scan) << ','
+				<< median(total) << ',' << *std::min_element(total.begin(), total.end()) << ','
+				<< stats.submittedPolygons << ',' << stats.culledBackFace << ',' << stats.culledNearFar << ','
+				<< stats.culledLeftRight << ',' << stats.rejectedPolygons << ',' << stats.insertedPolygons << ','
+				<< stats.sides << ',' << stats.peakActiveSides << ',' << stats.activeSideSwaps << ','
+				<< stats.spans << ',' << stats.resolvedSpans << ',' << stats.depthEvaluations << ','
+				<< stats.coherentSortRows << ',' << stats.fallbackSortRows << ',' << stats.sortWorkSaved << '\n';
+			out.flush();
+
+			fprintf(stderr, "%-24s %5dx%-5d %9.2f ms\n", qPrintable(scene.name),
+				resolution.width, resolution.height, median(total));
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,150 @@
+#include "MeshOptimizer.h"
+
+#include <algorithm>
+
+namespace MeshOptimizer = SpanningScanline::MeshOptimizer;
+
+float MeshOptimizer::averageCacheMissRatio(const unsigned int *indices, int indexCount, int vertexCount)
+{
+	if (indexCount < 3) {
+		return 0.f;
+	}
+
+	// A vertex is in the cache while fewer than kCacheSize misses happened
+	// since its own
+	QVector<int> missedAt(vertexCount, -kCacheSize - 1);
+	int misses = 0;
+
+	for (int i = 0; i < indexCount; i++) {
+		int &missed = missedAt[indices[i]];
+		if (misses - missed > kCacheSize) {
+			missed = misses++;
+		}
+	}
+
+	return float(misses) / (indexCount / 3);
+}
+
+void MeshOptimizer::optimizeVertexCache(unsigned int *indices, int indexCount, int vertexCount)
+{
+	const int triangleCount = indexCount / 3;
+	if (triangleCount == 0) {
+		return;
+	}
+
+	// Triangles around every vertex
+	QVector<int> fanStart(vertexCount + 1, 0);
+	for (int i = 0; i < triangleCount * 3; i++) {
+		fanStart[indices[i] + 1]++;
+	}
+	for (int v = 0; v < vertexCount; v++) {
+		fanStart[v + 1] += fanStart[v];
+	}
+
+	QVector<int> fans(triangleCount * 3);
+	QVector<int> fill(fanStart);
+	for (int i = 0; i < triangleCount * 3; i++) {
+		fans[fill[indices[i]]++] = i / 3;
+	}
+
+	// Triangles not emitted yet around every vertex, and when it last entered
+	// the cache. A vertex is in the cache while time - cachedAt <= kCacheSize.
+	QVector<int> live(vertexCount);
+	for (int v = 0; v < vertexCount; v++) {
+		live[v] = fanStart[v + 1] - fanStart[v];
+	}
+	QVector<int> cachedAt(vertexCount, 0);
+	int time = kCacheSize + 1;
+
+	QVector<char> emitted(triangleCount, 0);
+	QVector<unsigned int> output;
+	output.reserve(triangleCount * 3);
+
+	// Vertices of recently emitted triangles, to continue from once a fan runs
+	// out of cached neighbours
+	QVector<int> deadEnd;
+	QVector<int> candidates;
+	int cursor = 0;
+
+	int fan = indices[0];
+	while (fan >= 0) {
+		candidates.resize(0);
+
+		for (int f = fanStart[fan]; f < fanStart[fan + 1]; f++) {
+			const int t = fans[f];
+			if (emitted[t]) {
+				continue;
+			}
+			emitted[t] = 1;
+
+			for (int k = 0; k < 3; k++) {
+				const int v = indices[t * 3 + k];
+				output.push_back(v);
+				deadEnd.push_back(v);
+				candidates.push_back(v);
+				live[v]--;
+
+				if (time - cachedAt[v] > kCacheSize) {
+					cachedAt[v] = time++;
+				}
+			}
+		}
+
+		// The candidate that stays in the cache the longest while its fan is
+		// drawn, or the one entered first if none does
+		fan = -1;
+		int bestPriority = -1;
+		for (int v : candidates) {
+			if (live[v] == 0) {
+				continue;
+			}
+
+			int priority = 0;
+			if (time - cachedAt[v] + 2 * live[v] <= kCacheSize) {
+				priority = time - cachedAt[v];
+			}
+			if (priority > bestPriority) {
+				bestPriority = priority;
+				fan = v;
+			}
+		}
+
+		while (fan < 0 && !deadEnd.isEmpty()) {
+			const int v = deadEnd.last();
+			deadEnd.removeLast();
+			if (live[v] > 0) {
+				fan = v;
+			}
+		}
+
+		while (fan < 0 && cursor < vertexCount) {
+			if (live[cursor] > 0) {
+				fan = cursor;
+			}
+			cursor++;
+		}
+	}
+
+	std::copy(output.constData(), output.constData() + output.size(), indices);
+}
+
+QVector<int> MeshOptimizer::firstUseOrder(const unsigned int *indices, int indexCount, int vertexCount)
+{
+	QVector<int> order(vertexCount, -1);
+	int next = 0;
+
+	for (int i = 0; i < indexCount; i++) {
+		int &position = order[indices[i]];
+		if (position == -1) {
+			position = next++;
+		}
+	}
+
+	for (int v = 0; v < vertexCount; v++) {
+		if (order[v] == -1) {
+			order[v] = next++;
+		}
+	}
+
+	return order;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <QVector>
+
+namespace SpanningScanline {
+	// Reorders triangles and vertices of a mesh so consecutive triangles share
+	// vertices and vertex data is read front to back. Indices passed in are
+	// local to the mesh, 0 to vertexCount - 1.
+	namespace MeshOptimizer {
+		// Post-transform cache size the orders are tuned for and measured with
+		const int kCacheSize = 16;
+
+		// Vertices transformed per triangle by a FIFO cache of kCacheSize,
+		// between 0.5 for the best orders and 3
+		float averageCacheMissRatio(const unsigned int *indices, int indexCount, int vertexCount);
+
+		// Tipsify (Sander, Nehab and Barczak 2007): fans around one vertex at a
+		// time, moving on to a vertex that is still in the cache. Linear in the
+		// number of triangles.
+		void optimizeVertexCache(unsigned int *indices, int indexCount, int vertexCount);
+
+		// New position of every vertex: in the order indices first use them,
+		// unused vertices last
+		QVector<int> firstUseOrder(const unsigned int *indices, int indexCount, int vertexCount);
+	}
+}
@@ -0,0 +1,473 @@
+#include "MeshSimplifier.h"
+
+#include <QVarLengthArray>
+
+#include <algorithm>
+#include <cmath>
+
+using SpanningScanline::MeshSimplifier;
+
+namespace {
+	void cross(const float *a, const float *b, const float *c, float *n)
+	{
+		const float u[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+		const float v[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+
+		n[0] = u[1] * v[2] - u[2] * v[1];
+		n[1] = u[2] * v[0] - u[0] * v[2];
+		n[2] = u[0] * v[1] - u[1] * v[0];
+	}
+
+	float dot(const float *a, const float *b)
+	{
+		return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+	}
+}
+
+MeshSimplifier::MeshSimplifier(const float *vertices, const unsigned int *indices, int indexCount) :
+	m_scale(1.f),
+	m_error(0.f)
+{
+	indexCount -= indexCount % 3;
+	if (indexCount == 0) {
+		return;
+	}
+
+	// Local ids for the vertices in use, in the order they are first used
+	const unsigned int minIndex = *std::min_element(indices, indices + indexCount);
+	const unsigned int maxIndex = *std::max_element(indices, indices + indexCount);
+
+	QVector<int> localId(int(maxIndex - minIndex) + 1, -1);
+	m_triangles.resize(indexCount);
+
+	for (int i = 0; i < indexCount; i++) {
+		int &id = localId[int(indices[i] - minIndex)];
+		if (id == -1) {
+			id = m_bufferIndex.size();
+			m_bufferIndex.push_back(indices[i]);
+		}
+		m_triangles[i] = id;
+	}
+
+	buildPositions(vertices);
+
+	// Triangles already degenerate by position would only get in the way
+	int kept = 0;
+	for (int i = 0; i < indexCount; i += 3) {
+		const int a = m_positionOf[m_triangles[i]];
+		const int b = m_positionOf[m_triangles[i + 1]];
+		const int c = m_positionOf[m_triangles[i + 2]];
+
+		if (a != b && b != c && a != c) {
+			std::copy(m_triangles.constData() + i, m_triangles.constData() + i + 3, m_triangles.data() + kept);
+			kept += 3;
+		}
+	}
+	m_triangles.resize(kept);
+
+	buildQuadrics();
+	lockBorders();
+}
+
+void MeshSimplifier::buildPositions(const float *vertices)
+{
+	const int vertexCount = m_bufferIndex.size();
+	const unsigned int *bufferIndex = m_bufferIndex.constData();
+
+	// Vertices sorted by position, equal ones end up next to each other
+	QVector<int> order(vertexCount);
+	for (int i = 0; i < vertexCount; i++) {
+		order[i] = i;
+	}
+
+	std::sort(order.begin(), order.end(), [vertices, bufferIndex](int a, int b) {
+		const float *pa = vertices + bufferIndex[a] * 3;
+		const float *pb = vertices + bufferIndex[b] * 3;
+		return std::lexicographical_compare(pa, pa + 3, pb, pb + 3);
+	});
+
+	// Positions are scaled to the unit cube, so float quadrics are precise
+	// enough at any model size
+	float min[3] = { vertices[bufferIndex[0] * 3], vertices[bufferIndex[0] * 3 + 1], vertices[bufferIndex[0] * 3 + 2] };
+	float max[3] = { min[0], min[1], min[2] };
+	for (int i = 1; i < vertexCount; i++) {
+		const float *p = vertices + bufferIndex[i] * 3;
+		for (int c = 0; c < 3; c++) {
+			min[c] = std::min(min[c], p[c]);
+			max[c] = std::max(max[c], p[c]);
+		}
+	}
+
+	m_scale = std::max(max[0] - min[0], std::max(max[1] - min[1], max[2] - min[2]));
+	if (m_scale <= 0.f) {
+		m_scale = 1.f;
+	}
+
+	// Equal positions are next to each other in order now, the first vertex
+	// of every run stands for all of them
+	QVector<int> leader(vertexCount);
+	QVector<char> seam(vertexCount, 0);
+
+	for (int i = 0, run = 0; i < vertexCount; i++) {
+		const float *p = vertices + bufferIndex[order[i]] * 3;
+
+		if (i > 0 && std::equal(p, p + 3, vertices + bufferIndex[order[run]] * 3)) {
+			// A seam, the vertices differ in normal or texture coordinates
+			seam[order[run]] = 1;
+		}
+		else {
+			run = i;
+		}
+
+		leader[order[i]] = order[run];
+	}
+
+	// Positions numbered in the order vertices are first used, so those of
+	// one triangle are usually close in memory
+	QVector<int> positionOfLeader(vertexCount, -1);
+	m_positionOf.resize(vertexCount);
+	m_positions.resize(0);
+	m_locked.resize(0);
+
+	for (int v = 0; v < vertexCount; v++) {
+		int &position = positionOfLeader[leader[v]];
+
+		if (position == -1) {
+			const float *p = vertices + bufferIndex[v] * 3;
+
+			position = m_locked.size();
+			m_positions.push_back((p[0] - min[0]) / m_scale);
+			m_positions.push_back((p[1] - min[1]) / m_scale);
+			m_positions.push_back((p[2] - min[2]) / m_scale);
+			m_locked.push_back(seam[leader[v]]);
+		}
+
+		m_positionOf[v] = position;
+	}
+}
+
+void MeshSimplifier::buildQuadrics()
+{
+	Quadric zero;
+	std::fill(zero.m, zero.m + 10, 0.f);
+	zero.weight = 0.f;
+
+	m_quadrics.fill(zero, m_locked.size());
+
+	for (int i = 0; i < m_triangles.size(); i += 3) {
+		const int p[3] = { m_positionOf[m_triangles[i]], m_positionOf[m_triangles[i + 1]], m_positionOf[m_triangles[i + 2]] };
+		const float *a = m_positions.constData() + p[0] * 3;
+
+		float n[3];
+		cross(a, m_positions.constData() + p[1] * 3, m_positions.constData() + p[2] * 3, n);
+
+		const float length = std::sqrt(dot(n, n));
+		if (length == 0.f) {
+			continue;
+		}
+
+		const float x = n[0] / length, y = n[1] / length, z = n[2] / length;
+		const float d = -(x * a[0] + y * a[1] + z * a[2]);
+		const float area = length * 0.5f;
+		const float plane[10] = { x * x, x * y, x * z, x * d, y * y, y * z, y * d, z * z, z * d, d * d };
+
+		for (int k = 0; k < 3; k++) {
+			Quadric &q = m_quadrics[p[k]];
+			for (int j = 0; j < 10; j++) {
+				q.m[j] += plane[j] * area;
+			}
+			q.weight += area;
+		}
+	}
+}
+
+void MeshSimplifier::lockBorders()
+{
+	// Every edge as a pair of positions, smaller one first
+	QVector<quint64> edges;
+	edges.reserve(m_triangles.size());
+
+	for (int i = 0; i < m_triangles.size(); i += 3) {
+		for (int k = 0; k < 3; k++) {
+			const quint64 a = m_positionOf[m_triangles[i + k]];
+			const quint64 b = m_positionOf[m_triangles[i + (k + 1) % 3]];
+			edges.push_back(a < b ? (a << 32) | b : (b << 32) | a);
+		}
+	}
+
+	std::sort(edges.begin(), edges.end());
+
+	// Edges of one triangle are borders, of more than two non-manifold
+	for (int i = 0; i < edges.size();) {
+		int j = i + 1;
+		while (j < edges.size() && edges[j] == edges[i]) {
+			j++;
+		}
+
+		if (j - i != 2) {
+			m_locked[int(edges[i] >> 32)] = 1;
+			m_locked[int(edges[i] & 0xffffffffu)] = 1;
+		}
+
+		i = j;
+	}
+}
+
+void MeshSimplifier::simplify(int targetTriangles)
+{
+	const int positionCount = m_locked.size();
+	const int vertexCount = m_bufferIndex.size();
+
+	QVector<Collapse> collapses;
+	QVector<char> touched;
+	QVector<int> replacement(vertexCount);
+
+	// Passes of independent collapses: none of them changes the triangles
+	// another one looked at
+	while (triangleCount() > targetTriangles) {
+		m_fanStart.fill(0, positionCount + 1);
+		for (int v : m_triangles) {
+			m_fanStart[m_positionOf[v] + 1]++;
+		}
+		for (int p = 0; p < positionCount; p++) {
+			m_fanStart[p + 1] += m_fanStart[p];
+		}
+
+		m_fans.resize(m_triangles.size());
+		QVector<int> fill = m_fanStart;
+		for (int i = 0; i < m_triangles.size(); i++) {
+			m_fans[fill[m_positionOf[m_triangles[i]]]++] = i / 3;
+		}
+
+		collectCollapses(collapses);
+		std::sort(collapses.begin(), collapses.end(), [](const Collapse &a, const Collapse &b) {
+			return a.cost < b.cost;
+		});
+
+		touched.fill(0, positionCount);
+		for (int v = 0; v < vertexCount; v++) {
+			replacement[v] = v;
+		}
+
+		// Every collapse removes the two triangles along its edge
+		const int wanted = (triangleCount() - targetTriangles + 1) / 2;
+		int done = 0;
+
+		for (const Collapse &collapse : collapses) {
+			if (done >= wanted) {
+				break;
+			}
+
+			if (touched[collapse.from] || touched[collapse.to] ||
+				!keepsManifold(collapse.from, collapse.to) || flipsTriangle(collapse.from, collapse.to)) {
+				continue;
+			}
+
+			// An unlocked position has a single vertex, the one in its triangles
+			const int *triangle = m_triangles.constData() + m_fans[m_fanStart[collapse.from]] * 3;
+			for (int k = 0; k < 3; k++) {
+				if (m_positionOf[triangle[k]] == collapse.from) {
+					replacement[triangle[k]] = collapse.toVertex;
+				}
+			}
+
+			Quadric &to = m_quadrics[collapse.to];
+			const Quadric &from = m_quadrics[collapse.from];
+			for (int j = 0; j < 10; j++) {
+				to.m[j] += from.m[j];
+			}
+			to.weight += from.weight;
+
+			m_error = std::max(m_error, std::sqrt(collapse.cost));
+			markRing(collapse.from, touched);
+			done++;
+		}
+
+		if (done == 0) {
+			break;
+		}
+
+		int kept = 0;
+		for (int i = 0; i < m_triangles.size(); i += 3) {
+			const int a = replacement[m_triangles[i]];
+			const int b = replacement[m_triangles[i + 1]];
+			const int c = replacement[m_triangles[i + 2]];
+			const int pa = m_positionOf[a], pb = m_positionOf[b], pc = m_positionOf[c];
+
+			if (pa != pb && pb != pc && pa != pc) {
+				m_triangles[kept] = a;
+				m_triangles[kept + 1] = b;
+				m_triangles[kept + 2] = c;
+				kept += 3;
+			}
+		}
+		m_triangles.resize(kept);
+	}
+}
+
+QVector<unsigned int> MeshSimplifier::indices() const
+{
+	QVector<unsigned int> indices(m_triangles.size());
+	for (int i = 0; i < m_triangles.size(); i++) {
+		indices[i] = m_bufferIndex[m_triangles[i]];
+	}
+
+	return indices;
+}
+
+void MeshSimplifier::collectCollapses(QVector<Collapse> &collapses)
+{
+	const int positionCount = m_locked.size();
+	const int *triangles = m_triangles.constData();
+	const int *positionOf = m_positionOf.constData();
+	const int *fanStart = m_fanStart.constData();
+	const int *fans = m_fans.constData();
+	const char *locked = m_locked.constData();
+
+	QVector<Collapse> best(positionCount);
+	Collapse *bestData = best.data();
+
+	// The cheapest edge of every position that may move. An edge runs the
+	// other way in the triangle on its other side, so the edges leaving a
+	// position in each of its triangles are all of its edges.
+	#pragma omp parallel for schedule(dynamic, 1024)
+	for (int from = 0; from < positionCount; from++) {
+		Collapse &collapse = bestData[from];
+		collapse.from = -1;
+
+		if (locked[from]) {
+			continue;
+		}
+
+		for (int f = fanStart[from]; f < fanStart[from + 1]; f++) {
+			const int *triangle = triangles + fans[f] * 3;
+			const int k = positionOf[triangle[0]] == from ? 0 : positionOf[triangle[1]] == from ? 1 : 2;
+			const int toVertex = triangle[(k + 1) % 3];
+			const int to = positionOf[toVertex];
+			const float cost = collapseCost(from, to);
+
+			if (collapse.from == -1 || cost < collapse.cost) {
+				collapse.cost = cost;
+				collapse.from = from;
+				collapse.to = to;
+				collapse.toVertex = toVertex;
+			}
+		}
+	}
+
+	collapses.resize(0);
+	for (const Collapse &collapse : best) {
+		if (collapse.from != -1) {
+			collapses.push_back(collapse);
+		}
+	}
+}
+
+// Mean squared distance of the merged vertex from the planes around both
+float MeshSimplifier::collapseCost(int from, int to) const
+{
+	const Quadric &a = m_quadrics[from];
+	const Quadric &b = m_quadrics[to];
+
+	float m[10];
+	for (int j = 0; j < 10; j++) {
+		m[j] = a.m[j] + b.m[j];
+	}
+
+	const float *p = m_positions.constData() + to * 3;
+	const float x = p[0], y = p[1], z = p[2];
+	const float error = m[0] * x * x + 2.f * m[1] * x * y + 2.f * m[2] * x * z + 2.f * m[3] * x +
+		m[4] * y * y + 2.f * m[5] * y * z + 2.f * m[6] * y +
+		m[7] * z * z + 2.f * m[8] * z + m[9];
+
+	const float weight = a.weight + b.weight;
+
+	return weight > 0.f ? std::max(0.f, error / weight) : 0.f;
+}
+
+// Only the two positions opposite the edge may be next to both ends,
+// otherwise the collapse would fold the surface onto itself
+bool MeshSimplifier::keepsManifold(int from, int to) const
+{
+	QVarLengthArray<int, 32> rings[2];
+	const int ends[2] = { from, to };
+
+	for (int e = 0; e < 2; e++) {
+		for (int f = m_fanStart[ends[e]]; f < m_fanStart[ends[e] + 1]; f++) {
+			const int *triangle = m_triangles.constData() + m_fans[f] * 3;
+			for (int k = 0; k < 3; k++) {
+				const int p = m_positionOf[triangle[k]];
+				if (p != from && p != to) {
+					rings[e].append(p);
+				}
+			}
+		}
+		std::sort(rings[e].begin(), rings[e].end());
+		rings[e].resize(int(std::unique(rings[e].begin(), rings[e].end()) - rings[e].begin()));
+	}
+
+	int common = 0;
+	for (int i = 0, j = 0; i < rings[0].size() && j < rings[1].size();) {
+		if (rings[0][i] < rings[1][j]) {
+			i++;
+		}
+		else if (rings[1][j] < rings[0][i]) {
+			j++;
+		}
+		else {
+			common++;
+			i++;
+			j++;
+		}
+	}
+
+	return common <= 2;
+}
+
+// Whether a triangle that stays would turn over, or nearly so
+bool MeshSimplifier::flipsTriangle(int from, int to) const
+{
+	const float *target = m_positions.constData() + to * 3;
+
+	for (int f = m_fanStart[from]; f < m_fanStart[from + 1]; f++) {
+		const int *triangle = m_triangles.constData() + m_fans[f] * 3;
+		const float *corners[3];
+		const float *moved[3];
+		bool collapsing = false;
+
+		for (int k = 0; k < 3; k++) {
+			const int p = m_positionOf[triangle[k]];
+			collapsing |= p == to;
+			corners[k] = m_positions.constData() + p * 3;
+			moved[k] = p == from ? target : corners[k];
+		}
+
+		if (collapsing) {
+			continue;
+		}
+
+		float before[3], after[3];
+		cross(corners[0], corners[1], corners[2], before);
+		cross(moved[0], moved[1], moved[2], after);
+
+		if (dot(before, before) == 0.f) {
+			continue;
+		}
+
+		if (dot(before, after) <= 0.25f * std::sqrt(dot(before, before) * dot(after, after))) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void MeshSimplifier::markRing(int position, QVector<char> &touched) const
+{
+	for (int f = m_fanStart[position]; f < m_fanStart[position + 1]; f++) {
+		const int *triangle = m_triangles.constData() + m_fans[f] * 3;
+		for (int k = 0; k < 3; k++) {
+			touched[m_positionOf[triangle[k]]] = 1;
+		}
+	}
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <QVector>
+
+namespace SpanningScanline {
+	// Simplifies a triangle mesh step by step with quadric error edge
+	// collapses (Garland and Heckbert). A vertex only ever collapses onto one
+	// of its neighbours, so the simplified triangles still index the original
+	// vertices, normals and texture coordinates. Vertices on open borders, on
+	// texture or normal seams (several vertices at one position) and on
+	// non-manifold edges never move, so no cracks open up.
+	class MeshSimplifier
+	{
+	public:
+		// vertices holds x, y, z per vertex and indices three per triangle, as
+		// in ModelLoader's buffers. Only the vertices indexed are looked at.
+		MeshSimplifier(const float *vertices, const unsigned int *indices, int indexCount);
+
+		// Collapses edges, cheapest first, until at most targetTriangles are
+		// left or no edge can collapse any more. May be called again with a
+		// lower target to continue from there.
+		void simplify(int targetTriangles);
+
+		int triangleCount() const { return m_triangles.size() / 3; }
+		QVector<unsigned int> indices() const;
+
+		// The furthest any collapse so far moved the surface, in the
+		// coordinates of the vertex buffer
+		float error() const { return m_error * m_scale; }
+
+	private:
+		// Sum of squared distances to the planes of the triangles around a
+		// vertex, weighted by their area. Symmetric 4x4 matrix, upper half.
+		struct Quadric {
+			float m[10];
+			float weight;
+		};
+
+		struct Collapse {
+			float cost;
+			int from;		// Position that moves
+			int to;			// Position it moves to
+			int toVertex;	// Vertex of that position the moved one is replaced with
+		};
+
+		void buildPositions(const float *vertices);
+		void buildQuadrics();
+		void lockBorders();
+
+		void collectCollapses(QVector<Collapse> &collapses);
+		float collapseCost(int from, int to) const;
+		bool keepsManifold(int from, int to) const;
+		bool flipsTriangle(int from, int to) const;
+		void markRing(int position, QVector<char> &touched) const;
+
+		// Current triangles, three vertex ids each. Vertex ids are local, the
+		// buffer index of vertex i is m_bufferIndex[i].
+		QVector<int> m_triangles;
+		QVector<unsigned int> m_bufferIndex;
+		QVector<int> m_positionOf;		// Vertices at the same position share one
+
+		// By position
+		QVector<float> m_positions;		// x, y, z, scaled to the unit cube
+		float m_scale;
+		QVector<Quadric> m_quadrics;
+		QVector<char> m_locked;
+
+		// Triangles around every position, rebuilt for every pass
+		QVector<int> m_fanStart;
+		QVector<int> m_fans;
+
+		float m_error;
+	};
+}
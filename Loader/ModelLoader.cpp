@@ -1,12 +1,24 @@
-#include "modelloader.h"
+#include "ModelLoader.h"
+#include "MeshSimplifier.h"
+#include "MeshOptimizer.h"
+#include "Render/Texture.h"
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
 #include <assimp/Importer.hpp>
 #include <QDebug>
+#include <QFileInfo>
+#include <QDataStream>
+#include <QDateTime>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QCryptographicHash>
+#include <QHash>
+#include <algorithm>
 #include <limits>
 
 using SpanningScanline::MaterialInfo;
 using SpanningScanline::LightInfo;
+using SpanningScanline::MeshLevel;
 using SpanningScanline::Mesh;
 using SpanningScanline::Node;
 
@@ -15,7 +27,11 @@ using SpanningScanline::ModelLoader;
 #define DEBUGOUTPUT_NORMALS(nodeIndex) (false)//( QList<int>{1}.contains(nodeIndex) )//(false)
 
 ModelLoader::ModelLoader(bool transformToUnitCoordinates) :
-    m_transformToUnitCoordinates(transformToUnitCoordinates)
+    m_transformToUnitCoordinates(transformToUnitCoordinates),
+    m_buildLevelsOfDetail(true),
+    m_optimizeVertexOrder(false),
+    m_importProfile(ImportFull),
+    m_cacheDirectory(QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/models")
 {
 
 }
@@ -52,15 +68,57 @@ bool ModelLoader::load(QString filePath, PathType pathType)
     else
         l_filePath = filePath;
 
-    Assimp::Importer importer;
-	
-    const aiScene* scene = importer.ReadFile( l_filePath.toStdString(),
+    const QFileInfo sourceInfo(l_filePath);
+    unsigned int importFlags =
             aiProcess_GenSmoothNormals      |
-            aiProcess_CalcTangentSpace       |
             aiProcess_Triangulate       |
             aiProcess_JoinIdenticalVertices  |
-            aiProcess_SortByPType
-                                              );
+            aiProcess_SortByPType;
+
+    // Tangent space is only for normal mapping, which the renderer does not do
+    if (m_importProfile == ImportFull)
+        importFlags |= aiProcess_CalcTangentSpace;
+
+    const QString cachePath = cacheFilePath(sourceInfo);
+
+    if(!cachePath.isEmpty() && readCache(cachePath, sourceInfo, importFlags))
+    {
+        if (m_importProfile == ImportFull)
+            qDebug() << "Loaded from cache" << cachePath;
+    }
+    else
+    {
+        clear();
+
+        if(!importScene(l_filePath, importFlags))
+            return false;
+
+        if(!cachePath.isEmpty() && !writeCache(cachePath, sourceInfo, importFlags))
+            qDebug() << "Warning: Cannot write model cache" << cachePath;
+    }
+
+    // Texture paths are relative to the model file. Loaded once, materials
+    // sharing a file share the texture and its mip chain.
+    QDir modelDir = sourceInfo.absoluteDir();
+    for(int ii=0; ii<m_materials.size(); ++ii)
+    {
+        MaterialInfo &mater = *m_materials[ii];
+        if(mater.isTexture)
+            mater.texture = Texture::load(modelDir.filePath(QDir::fromNativeSeparators(mater.textureName)));
+    }
+
+    // This will transform the model to unit coordinates, so a model of any size or shape will fit on screen
+    if (m_transformToUnitCoordinates)
+        transformToUnitCoordinates();
+
+    return true;
+}
+
+bool ModelLoader::importScene(const QString &filePath, unsigned int importFlags)
+{
+    Assimp::Importer importer;
+	
+    const aiScene* scene = importer.ReadFile( filePath.toStdString(), importFlags);
 
     if( !scene)
     {
@@ -72,17 +130,13 @@ bool ModelLoader::load(QString filePath, PathType pathType)
     {
         for(unsigned int ii=0; ii<scene->mNumMaterials; ++ii)
         {
-            QSharedPointer<MaterialInfo> mater = processMaterial(scene->mMaterials[ii]);
-            m_materials.push_back(mater);
+            m_materials.push_back(processMaterial(scene->mMaterials[ii]));
         }
     }
 
     if(scene->HasMeshes())
     {
-        for(unsigned int ii=0; ii<scene->mNumMeshes; ++ii)
-        {
-            m_meshes.push_back(processMesh(scene->mMeshes[ii]));
-        }
+        processMeshes(scene);
     }
     else
     {
@@ -90,7 +144,13 @@ bool ModelLoader::load(QString filePath, PathType pathType)
         return false;
     }
 
-    if(scene->HasLights())
+    if (m_buildLevelsOfDetail)
+        buildLevelsOfDetail();
+
+    if (m_optimizeVertexOrder)
+        optimizeVertexOrder();
+
+    if(m_importProfile == ImportFull && scene->HasLights())
     {
         qDebug() << "Has Lights";
     }
@@ -99,6 +159,7 @@ bool ModelLoader::load(QString filePath, PathType pathType)
     {
         Node *rootNode = new Node;
         processNode(scene, scene->mRootNode, 0, *rootNode);
+        findNodeBounds(*rootNode);
         m_rootNode.reset(rootNode);
     }
     else
@@ -107,13 +168,24 @@ bool ModelLoader::load(QString filePath, PathType pathType)
         return false;
     }
 
-    // This will transform the model to unit coordinates, so a model of any size or shape will fit on screen
-    if (m_transformToUnitCoordinates)
-        transformToUnitCoordinates();
-
     return true;
 }
 
+void ModelLoader::clear()
+{
+    m_vertices.clear();
+    m_normals.clear();
+    m_indices.clear();
+    m_levelIndices.clear();
+    m_textureUV.clear();
+    m_tangents.clear();
+    m_bitangents.clear();
+    m_numUVComponents.clear();
+    m_materials.clear();
+    m_meshes.clear();
+    m_rootNode.reset();
+}
+
 void ModelLoader::getBufferData( QVector<float> **vertices, QVector<float> **normals, QVector<unsigned int> **indices)
 {
     if(vertices != 0)
@@ -138,6 +210,311 @@ void ModelLoader::getTextureData(QVector<QVector<float> > **textureUV, QVector<f
         *bitangents = &m_bitangents;
 }
 
+namespace
+{
+    // Bump when the layout below or what the loader stores in its buffers changes
+    const quint32 kCacheMagic = 0x5353434d; // "SSCM"
+    const quint32 kCacheVersion = 5;
+
+    // readCache() maps the whole file into one QByteArray, which an int sizes
+    const qint64 kMaxCacheSize = std::numeric_limits<int>::max();
+
+    // Buffers are stored as they are in memory, so reading one is a single copy
+    // out of the mapped file
+    template <typename T>
+    void writeArray(QDataStream &out, const QVector<T> &array)
+    {
+        out << quint64(array.size());
+        out.writeRawData(reinterpret_cast<const char *>(array.constData()), int(array.size() * sizeof(T)));
+    }
+
+    template <typename T>
+    qint64 arrayBytes(const QVector<T> &array)
+    {
+        return qint64(array.size()) * qint64(sizeof(T));
+    }
+
+    template <typename T>
+    bool readArray(QDataStream &in, QVector<T> &array)
+    {
+        quint64 count;
+        in >> count;
+
+        const qint64 left = in.device()->size() - in.device()->pos();
+        if(in.status() != QDataStream::Ok || count > quint64(left) / sizeof(T))
+            return false;
+
+        array.resize(int(count));
+        const int bytes = int(count * sizeof(T));
+        return in.readRawData(reinterpret_cast<char *>(array.data()), bytes) == bytes;
+    }
+
+    // The renderer indexes its buffers without checking, so a cache that does
+    // not add up is ignored rather than trusted
+    bool coversVertices(const QVector<float> &buffer, quint64 components, quint64 vertexCount)
+    {
+        return quint64(buffer.size()) == vertexCount * components;
+    }
+
+    bool indicesWithin(const QVector<unsigned int> &indices, quint32 offset, quint32 count,
+                       quint64 firstVertex, quint64 endVertex)
+    {
+        if(count % 3 != 0 || quint64(offset) + count > quint64(indices.size()))
+            return false;
+
+        const unsigned int *range = indices.constData() + offset;
+        for(quint32 ii=0; ii<count; ++ii)
+        {
+            if(range[ii] < firstVertex || range[ii] >= endVertex)
+                return false;
+        }
+        return true;
+    }
+
+    void writeNode(QDataStream &out, const Node &node, const QHash<const Mesh *, int> &meshIndex)
+    {
+        out << node.name << node.transformation << node.boundsMin << node.boundsMax;
+
+        out << quint32(node.meshes.size());
+        for(int ii=0; ii<node.meshes.size(); ++ii)
+            out << qint32(meshIndex.value(node.meshes[ii].data()));
+
+        out << quint32(node.nodes.size());
+        for(int ii=0; ii<node.nodes.size(); ++ii)
+            writeNode(out, node.nodes[ii], meshIndex);
+    }
+
+    bool readNode(QDataStream &in, Node &node, const QVector<QSharedPointer<Mesh> > &meshes)
+    {
+        in >> node.name >> node.transformation >> node.boundsMin >> node.boundsMax;
+
+        quint32 meshCount;
+        in >> meshCount;
+        if(in.status() != QDataStream::Ok || meshCount > quint32(meshes.size()))
+            return false;
+
+        node.meshes.resize(meshCount);
+        for(quint32 ii=0; ii<meshCount; ++ii)
+        {
+            qint32 index;
+            in >> index;
+            if(index < 0 || index >= meshes.size())
+                return false;
+            node.meshes[ii] = meshes[index];
+        }
+
+        quint32 childCount;
+        in >> childCount;
+        if(in.status() != QDataStream::Ok)
+            return false;
+
+        for(quint32 ii=0; ii<childCount; ++ii)
+        {
+            node.nodes.push_back(Node());
+            if(!readNode(in, node.nodes.last(), meshes))
+                return false;
+        }
+
+        return in.status() == QDataStream::Ok;
+    }
+}
+
+QString ModelLoader::cacheFilePath(const QFileInfo &source) const
+{
+    if(m_cacheDirectory.isEmpty() || !source.exists())
+        return QString();
+
+    // One file per source path, the key inside tells whether it is still current
+    const QByteArray pathHash = QCryptographicHash::hash(source.absoluteFilePath().toUtf8(), QCryptographicHash::Sha1).toHex();
+    return QDir(m_cacheDirectory).filePath(QString::fromLatin1(pathHash) + ".sscache");
+}
+
+bool ModelLoader::readCache(const QString &cachePath, const QFileInfo &source, unsigned int importFlags)
+{
+    QFile file(cachePath);
+    if(!file.open(QIODevice::ReadOnly))
+        return false;
+
+    if(file.size() > kMaxCacheSize)
+        return false;
+
+    // Mapped instead of read, the buffers are copied straight out of the page cache
+    uchar *data = file.size() > 0 ? file.map(0, file.size()) : 0;
+    if(data == 0)
+        return false;
+
+    const QByteArray bytes = QByteArray::fromRawData(reinterpret_cast<const char *>(data), int(file.size()));
+    QDataStream in(bytes);
+    in.setVersion(QDataStream::Qt_5_0);
+    in.setFloatingPointPrecision(QDataStream::SinglePrecision);
+
+    quint32 magic, version, flags;
+    qint32 byteOrder, profile;
+    QString path;
+    qint64 modified, size;
+    bool levelsOfDetail, optimized;
+    in >> magic >> version >> byteOrder >> path >> modified >> size >> flags >> profile >> levelsOfDetail >> optimized;
+
+    if(in.status() != QDataStream::Ok || magic != kCacheMagic || version != kCacheVersion ||
+       byteOrder != QSysInfo::ByteOrder || path != source.absoluteFilePath() ||
+       modified != source.lastModified().toMSecsSinceEpoch() || size != source.size() ||
+       flags != importFlags || profile != m_importProfile ||
+       levelsOfDetail != m_buildLevelsOfDetail || optimized != m_optimizeVertexOrder)
+        return false;
+
+    clear();
+
+    bool ok = readArray(in, m_vertices) && readArray(in, m_normals) && readArray(in, m_indices) &&
+              readArray(in, m_levelIndices) && readArray(in, m_tangents) && readArray(in, m_bitangents);
+
+    const int vertexCount = m_vertices.size() / 3;
+    ok = ok && m_vertices.size() % 3 == 0 &&
+         (m_normals.isEmpty() || coversVertices(m_normals, 3, vertexCount)) &&
+         (m_tangents.isEmpty() || coversVertices(m_tangents, 3, vertexCount)) &&
+         (m_bitangents.isEmpty() || coversVertices(m_bitangents, 3, vertexCount)) &&
+         indicesWithin(m_indices, 0, m_indices.size(), 0, vertexCount);
+
+    quint32 channelCount = 0;
+    in >> channelCount;
+    ok = ok && in.status() == QDataStream::Ok && readArray(in, m_numUVComponents) &&
+         channelCount == quint32(m_numUVComponents.size());
+
+    m_textureUV.resize(ok ? channelCount : 0);
+    for(int ii=0; ok && ii<m_textureUV.size(); ++ii)
+        ok = readArray(in, m_textureUV[ii]) && coversVertices(m_textureUV[ii], m_numUVComponents[ii], vertexCount);
+
+    quint32 materialCount = 0;
+    in >> materialCount;
+    for(quint32 ii=0; ok && ii<materialCount; ++ii)
+    {
+        QSharedPointer<MaterialInfo> mater(new MaterialInfo);
+        in >> mater->Name >> mater->Ambient >> mater->Diffuse >> mater->Specular >> mater->Shininess
+           >> mater->isTexture >> mater->textureName;
+        ok = in.status() == QDataStream::Ok;
+        m_materials.push_back(mater);
+    }
+
+    quint32 meshCount = 0;
+    in >> meshCount;
+    for(quint32 ii=0; ok && ii<meshCount; ++ii)
+    {
+        QSharedPointer<Mesh> mesh(new Mesh);
+        qint32 material;
+        quint32 levelCount;
+        in >> mesh->name >> mesh->indexCount >> mesh->indexOffset >> mesh->vertexCount >> mesh->vertexOffset
+           >> material >> mesh->boundsMin >> mesh->boundsMax >> mesh->numUVChannels
+           >> mesh->hasTangentsAndBitangents >> mesh->hasNormals >> mesh->hasBones >> levelCount;
+
+        // Every triangle, of the mesh and of its levels, only uses the mesh's vertices
+        const quint64 endVertex = quint64(mesh->vertexOffset) + mesh->vertexCount;
+        ok = in.status() == QDataStream::Ok && material >= -1 && material < m_materials.size() &&
+             endVertex <= quint64(vertexCount) &&
+             indicesWithin(m_indices, mesh->indexOffset, mesh->indexCount, mesh->vertexOffset, endVertex);
+        for(quint32 il=0; ok && il<levelCount; ++il)
+        {
+            MeshLevel level;
+            in >> level.indexCount >> level.indexOffset >> level.error;
+            ok = in.status() == QDataStream::Ok &&
+                 indicesWithin(m_levelIndices, level.indexOffset, level.indexCount, mesh->vertexOffset, endVertex);
+            mesh->levels.push_back(level);
+        }
+
+        if(ok && material >= 0)
+            mesh->material = m_materials[material];
+        m_meshes.push_back(mesh);
+    }
+
+    if(ok)
+    {
+        m_rootNode.reset(new Node);
+        ok = readNode(in, *m_rootNode, m_meshes);
+    }
+
+    if(!ok)
+    {
+        qDebug() << "Warning: Ignoring damaged model cache" << cachePath;
+        clear();
+    }
+
+    return ok;
+}
+
+bool ModelLoader::writeCache(const QString &cachePath, const QFileInfo &source, unsigned int importFlags) const
+{
+    // A cache that could never be read back is not worth writing. The
+    // buffers are nearly all of it, materials and nodes are checked below.
+    qint64 bufferBytes = arrayBytes(m_vertices) + arrayBytes(m_normals) + arrayBytes(m_indices) +
+                         arrayBytes(m_levelIndices) + arrayBytes(m_tangents) + arrayBytes(m_bitangents);
+    for(int ii=0; ii<m_textureUV.size(); ++ii)
+        bufferBytes += arrayBytes(m_textureUV[ii]);
+    if(bufferBytes > kMaxCacheSize)
+        return false;
+
+    if(!QDir().mkpath(QFileInfo(cachePath).absolutePath()))
+        return false;
+
+    // Written aside and renamed when complete, a reader never sees half a file
+    QSaveFile file(cachePath);
+    if(!file.open(QIODevice::WriteOnly))
+        return false;
+
+    QDataStream out(&file);
+    out.setVersion(QDataStream::Qt_5_0);
+    out.setFloatingPointPrecision(QDataStream::SinglePrecision);
+
+    out << kCacheMagic << kCacheVersion << qint32(QSysInfo::ByteOrder) << source.absoluteFilePath()
+        << qint64(source.lastModified().toMSecsSinceEpoch()) << qint64(source.size())
+        << quint32(importFlags) << qint32(m_importProfile) << m_buildLevelsOfDetail << m_optimizeVertexOrder;
+
+    writeArray(out, m_vertices);
+    writeArray(out, m_normals);
+    writeArray(out, m_indices);
+    writeArray(out, m_levelIndices);
+    writeArray(out, m_tangents);
+    writeArray(out, m_bitangents);
+
+    out << quint32(m_textureUV.size());
+    writeArray(out, m_numUVComponents);
+    for(int ii=0; ii<m_textureUV.size(); ++ii)
+        writeArray(out, m_textureUV[ii]);
+
+    QHash<const MaterialInfo *, int> materialIndex;
+    out << quint32(m_materials.size());
+    for(int ii=0; ii<m_materials.size(); ++ii)
+    {
+        const MaterialInfo &mater = *m_materials[ii];
+        out << mater.Name << mater.Ambient << mater.Diffuse << mater.Specular << mater.Shininess
+            << mater.isTexture << mater.textureName;
+        materialIndex.insert(&mater, ii);
+    }
+
+    QHash<const Mesh *, int> meshIndex;
+    out << quint32(m_meshes.size());
+    for(int ii=0; ii<m_meshes.size(); ++ii)
+    {
+        const Mesh &mesh = *m_meshes[ii];
+        out << mesh.name << mesh.indexCount << mesh.indexOffset << mesh.vertexCount << mesh.vertexOffset
+            << qint32(materialIndex.value(mesh.material.data(), -1)) << mesh.boundsMin << mesh.boundsMax
+            << mesh.numUVChannels << mesh.hasTangentsAndBitangents << mesh.hasNormals << mesh.hasBones
+            << quint32(mesh.levels.size());
+
+        for(int il=0; il<mesh.levels.size(); ++il)
+            out << mesh.levels[il].indexCount << mesh.levels[il].indexOffset << mesh.levels[il].error;
+
+        meshIndex.insert(&mesh, ii);
+    }
+
+    writeNode(out, *m_rootNode, meshIndex);
+
+    if(out.status() != QDataStream::Ok || file.size() > kMaxCacheSize)
+    {
+        file.cancelWriting();
+        return false;
+    }
+
+    return file.commit();
+}
+
 QSharedPointer<SpanningScanline::MaterialInfo> ModelLoader::processMaterial(aiMaterial *material)
 {
     QSharedPointer<MaterialInfo> mater(new MaterialInfo);
@@ -148,13 +525,21 @@ QSharedPointer<SpanningScanline::MaterialInfo> ModelLoader::processMaterial(aiMa
         mater->Name = mname.C_Str();
     mater->isTexture = false;
 
-    int shadingModel;
+    // Left as is when the material has no shading model, as for most STL and PLY files
+    int shadingModel = 0;
     material->Get( AI_MATKEY_SHADING_MODEL, shadingModel );
 
     if(shadingModel != aiShadingMode_Phong && shadingModel != aiShadingMode_Gouraud)
     {
-        qDebug() << "This mesh's shading model is not implemented in this loader, setting to default material";
+        if(m_importProfile == ImportFull)
+            qDebug() << "This mesh's shading model is not implemented in this loader, setting to default material";
         mater->Name = "DefaultMaterial";
+
+        // Plain white, lit like a model without materials
+        mater->Ambient = QVector3D(0.f, 0.f, 0.f);
+        mater->Diffuse = QVector3D(1.f, 1.f, 1.f);
+        mater->Specular = QVector3D(0.f, 0.f, 0.f);
+        mater->Shininess = 0.f;
     }
     else
     {
@@ -177,146 +562,218 @@ QSharedPointer<SpanningScanline::MaterialInfo> ModelLoader::processMaterial(aiMa
         if( mater->Shininess == 0.0) mater->Shininess = 30;
 
         if (material->GetTextureCount(aiTextureType_DIFFUSE) > 0) {
-            qDebug() << "Diffuse Texture(s) Found:" << material->GetTextureCount(aiTextureType_DIFFUSE)
-                     << "for Material:" << mater->Name;
+            if (m_importProfile == ImportFull)
+                qDebug() << "Diffuse Texture(s) Found:" << material->GetTextureCount(aiTextureType_DIFFUSE)
+                         << "for Material:" << mater->Name;
             aiString texPath;
 
             if (material->GetTexture(aiTextureType_DIFFUSE, 0, &texPath, NULL, NULL, NULL, NULL, NULL) == AI_SUCCESS) {
                 QString texturePath = texPath.data;
                 mater->isTexture = true;
                 mater->textureName = texturePath;
-                qDebug() << "  Texture path" << texturePath;
+                if (m_importProfile == ImportFull)
+                    qDebug() << "  Texture path" << texturePath;
             }
             else
-                qDebug() << "  Failed to get texture for material";
+                qDebug() << "Warning: Failed to get texture for material" << mater->Name;
         }
     }
 
     return mater;
 }
 
-QSharedPointer<SpanningScanline::Mesh> ModelLoader::processMesh(aiMesh *mesh)
+// The renderer maps only the first channel
+unsigned int ModelLoader::importedUVChannels(const aiMesh *mesh) const
+{
+    if (m_importProfile == ImportRenderOnly)
+        return qMin(mesh->GetNumUVChannels(), 1u);
+
+    return mesh->GetNumUVChannels();
+}
+
+void ModelLoader::processMeshes(const aiScene *scene)
+{
+    const int meshCount = scene->mNumMeshes;
+    QVector<unsigned int> vertexOffsets(meshCount + 1, 0);
+    QVector<unsigned int> indexOffsets(meshCount + 1, 0);
+
+    // First pass: the size of every mesh, so each buffer is allocated once and
+    // every mesh knows its range before any of them is copied
+    #pragma omp parallel for schedule(dynamic, 16)
+    for(int ii=0; ii<meshCount; ++ii)
+    {
+        const aiMesh *mesh = scene->mMeshes[ii];
+        unsigned int triangles = 0;
+        for(uint t = 0; t<mesh->mNumFaces; ++t)
+        {
+            if(mesh->mFaces[t].mNumIndices == 3)
+                ++triangles;
+        }
+
+        vertexOffsets[ii + 1] = mesh->mNumVertices;
+        indexOffsets[ii + 1] = triangles * 3;
+    }
+
+    bool hasNormals = false;
+    bool hasTangents = false;
+    for(int ii=0; ii<meshCount; ++ii)
+    {
+        const aiMesh *mesh = scene->mMeshes[ii];
+        if(indexOffsets[ii + 1] != mesh->mNumFaces * 3)
+            qDebug() << "Warning: Mesh faces with not exactly 3 indices, ignoring" << mesh->mNumFaces - indexOffsets[ii + 1] / 3 << "primitives.";
+
+        vertexOffsets[ii + 1] += vertexOffsets[ii];
+        indexOffsets[ii + 1] += indexOffsets[ii];
+
+        hasNormals |= mesh->HasNormals();
+        hasTangents |= m_importProfile == ImportFull && mesh->HasTangentsAndBitangents();
+
+        for(unsigned int mchanInd = 0; mchanInd < importedUVChannels(mesh); ++mchanInd)
+        {
+            Q_ASSERT(mesh->mNumUVComponents[mchanInd] == 2 && "Error: Texture Mapping Component Count must be 2. Others not supported");
+
+            if((unsigned int)m_textureUV.size() <= mchanInd)
+            {
+                m_textureUV.resize(mchanInd + 1);
+                m_numUVComponents.resize(mchanInd + 1);
+            }
+            m_numUVComponents[mchanInd] = mesh->mNumUVComponents[mchanInd];
+        }
+    }
+
+    // Vertices of meshes without normals, tangents or some uv channel stay zero
+    const int vertexCount = vertexOffsets[meshCount];
+    m_vertices.resize(vertexCount * 3);
+    m_indices.resize(indexOffsets[meshCount]);
+    if(hasNormals)
+        m_normals.fill(0.f, vertexCount * 3);
+    if(hasTangents)
+    {
+        m_tangents.fill(0.f, vertexCount * 3);
+        m_bitangents.fill(0.f, vertexCount * 3);
+    }
+    for(int mchanInd = 0; mchanInd < m_textureUV.size(); ++mchanInd)
+        m_textureUV[mchanInd].fill(0.f, vertexCount * m_numUVComponents[mchanInd]);
+
+    // Second pass: meshes write to disjoint ranges of the buffers
+    m_meshes.resize(meshCount);
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(int ii=0; ii<meshCount; ++ii)
+    {
+        m_meshes[ii] = processMesh(scene->mMeshes[ii], vertexOffsets[ii], indexOffsets[ii], indexOffsets[ii + 1] - indexOffsets[ii]);
+    }
+}
+
+QSharedPointer<SpanningScanline::Mesh> ModelLoader::processMesh(aiMesh *mesh, unsigned int vertexOffset, unsigned int indexOffset, unsigned int indexCount)
 {
     QSharedPointer<Mesh> newMesh(new Mesh);
     newMesh->name = mesh->mName.length != 0 ? mesh->mName.C_Str() : "";
-    newMesh->indexOffset = m_indices.size();
-    unsigned int indexCountBefore = m_indices.size();
-    int vertindexoffset = m_vertices.size()/3;
+    newMesh->indexOffset = indexOffset;
+    newMesh->indexCount = indexCount;
+    newMesh->vertexOffset = vertexOffset;
+    newMesh->vertexCount = mesh->mNumVertices;
 
-    newMesh->numUVChannels = mesh->GetNumUVChannels();
-    newMesh->hasTangentsAndBitangents = mesh->HasTangentsAndBitangents();
+    newMesh->numUVChannels = importedUVChannels(mesh);
+    newMesh->hasTangentsAndBitangents = m_importProfile == ImportFull && mesh->HasTangentsAndBitangents();
     newMesh->hasNormals = mesh->HasNormals();
     newMesh->hasBones = mesh->HasBones();
+    newMesh->material = m_materials.at(mesh->mMaterialIndex);
 
     // Get Vertices
-    if(mesh->mNumVertices > 0)
-    {
-        for(uint ii=0; ii<mesh->mNumVertices; ++ii)
-        {
-            aiVector3D &vec = mesh->mVertices[ii];
+    double amin = std::numeric_limits<double>::max();
+    double amax = -std::numeric_limits<double>::max();
+    newMesh->boundsMin = QVector3D(amin,amin,amin);
+    newMesh->boundsMax = QVector3D(amax,amax,amax);
 
-            m_vertices.push_back(vec.x);
-            m_vertices.push_back(vec.y);
-            m_vertices.push_back(vec.z);
-        }
+    // Buffers are only touched for a mesh that has something to write to
+    // them, so none of them is empty and data() never allocates here
+    if(mesh->mNumVertices == 0)
+        return newMesh;
+
+    float *vertices = m_vertices.data() + vertexOffset * 3;
+    for(uint ii=0; ii<mesh->mNumVertices; ++ii)
+    {
+        const aiVector3D &vec = mesh->mVertices[ii];
+
+        vertices[ii*3] = vec.x;
+        vertices[ii*3+1] = vec.y;
+        vertices[ii*3+2] = vec.z;
+
+        newMesh->boundsMin.setX(qMin(newMesh->boundsMin.x(), vec.x));
+        newMesh->boundsMin.setY(qMin(newMesh->boundsMin.y(), vec.y));
+        newMesh->boundsMin.setZ(qMin(newMesh->boundsMin.z(), vec.z));
+        newMesh->boundsMax.setX(qMax(newMesh->boundsMax.x(), vec.x));
+        newMesh->boundsMax.setY(qMax(newMesh->boundsMax.y(), vec.y));
+        newMesh->boundsMax.setZ(qMax(newMesh->boundsMax.z(), vec.z));
     }
 
     // Get Normals
     if(mesh->HasNormals())
     {
-        m_normals.resize(m_vertices.size());
-
-        int nind = vertindexoffset * 3;
-
+        float *normals = m_normals.data() + vertexOffset * 3;
         for(uint ii=0; ii<mesh->mNumVertices; ++ii)
         {
-            aiVector3D &vec = mesh->mNormals[ii];
-            m_normals[nind] = vec.x;
-            m_normals[nind+1] = vec.y;
-            m_normals[nind+2] = vec.z;
-            nind += 3;
-        };
+            const aiVector3D &vec = mesh->mNormals[ii];
+            normals[ii*3] = vec.x;
+            normals[ii*3+1] = vec.y;
+            normals[ii*3+2] = vec.z;
+        }
     }
 
     // Get Texture coordinates
-    if(mesh->GetNumUVChannels() > 0)
+    for(unsigned int mchanInd = 0; mchanInd < newMesh->numUVChannels; ++mchanInd)
     {
-        if((unsigned int)m_textureUV.size() < mesh->GetNumUVChannels()) // Caution, assumes all meshes in this model have same number of uv channels
-        {
-            m_textureUV.resize(mesh->GetNumUVChannels());
-            m_numUVComponents.resize(mesh->GetNumUVChannels());
-        }
+        const unsigned int numComponents = m_numUVComponents[mchanInd];
+        float *uv = m_textureUV[mchanInd].data() + vertexOffset * numComponents;
 
-        for( unsigned int mchanInd = 0; mchanInd < mesh->GetNumUVChannels(); ++mchanInd)
+        for(uint iind = 0; iind<mesh->mNumVertices; ++iind)
         {
-            Q_ASSERT(mesh->mNumUVComponents[mchanInd] == 2 && "Error: Texture Mapping Component Count must be 2. Others not supported");
-
-            m_numUVComponents[mchanInd] = mesh->mNumUVComponents[mchanInd];
-            m_textureUV[mchanInd].resize((m_vertices.size()/3)*2);
-
-            int uvind = vertindexoffset * m_numUVComponents[mchanInd];
-
-            for(uint iind = 0; iind<mesh->mNumVertices; ++iind)
-            {
-                // U
-                m_textureUV[mchanInd][uvind] = mesh->mTextureCoords[mchanInd][iind].x;
-                if(mesh->mNumUVComponents[mchanInd] > 1)
-                {
-                    // V
-                    m_textureUV[mchanInd][uvind+1] = mesh->mTextureCoords[mchanInd][iind].y;
-                    if(mesh->mNumUVComponents[mchanInd] > 2)
-                    {
-                        // W
-                        m_textureUV[mchanInd][uvind+2] = mesh->mTextureCoords[mchanInd][iind].z;
-                    }
-                }
-                uvind += m_numUVComponents[mchanInd];
-            }
+            const aiVector3D &coords = mesh->mTextureCoords[mchanInd][iind];
+            // U, V, W
+            for(unsigned int n = 0; n < numComponents && n < 3; ++n)
+                uv[n] = coords[n];
+            uv += numComponents;
         }
     }
 
     // Get Tangents and bitangents
-    if(mesh->HasTangentsAndBitangents())
+    if(newMesh->hasTangentsAndBitangents)
     {
-        m_tangents.resize(m_vertices.size());
-        m_bitangents.resize(m_vertices.size());
-
-        int tind = vertindexoffset * 3;
+        float *tangents = m_tangents.data() + vertexOffset * 3;
+        float *bitangents = m_bitangents.data() + vertexOffset * 3;
 
         for(uint ii=0; ii<mesh->mNumVertices; ++ii)
         {
-            aiVector3D &vec = mesh->mTangents[ii];
-            m_tangents[tind] = vec.x;
-            m_tangents[tind+1] = vec.y;
-            m_tangents[tind+2] = vec.z;
-
-            aiVector3D &vec2 = mesh->mBitangents[ii];
-            m_bitangents[tind] = vec2.x;
-            m_bitangents[tind+1] = vec2.y;
-            m_bitangents[tind+2] = vec2.z;
-
-            tind += 3;
-        };
+            const aiVector3D &vec = mesh->mTangents[ii];
+            tangents[ii*3] = vec.x;
+            tangents[ii*3+1] = vec.y;
+            tangents[ii*3+2] = vec.z;
+
+            const aiVector3D &vec2 = mesh->mBitangents[ii];
+            bitangents[ii*3] = vec2.x;
+            bitangents[ii*3+1] = vec2.y;
+            bitangents[ii*3+2] = vec2.z;
+        }
     }
 
-    // Get mesh indexes
-    for(uint t = 0; t<mesh->mNumFaces; ++t)
+    // Get mesh indexes, faces with other than 3 indices were counted out before
+    if(indexCount > 0)
     {
-        aiFace* face = &mesh->mFaces[t];
-        if(face->mNumIndices != 3)
+        unsigned int *indices = m_indices.data() + indexOffset;
+        for(uint t = 0; t<mesh->mNumFaces; ++t)
         {
-            qDebug() << "Warning: Mesh face with not exactly 3 indices, ignoring this primitive." << face->mNumIndices;
-            continue;
+            const aiFace &face = mesh->mFaces[t];
+            if(face.mNumIndices != 3)
+                continue;
+
+            indices[0] = face.mIndices[0] + vertexOffset;
+            indices[1] = face.mIndices[1] + vertexOffset;
+            indices[2] = face.mIndices[2] + vertexOffset;
+            indices += 3;
         }
-
-        m_indices.push_back(face->mIndices[0]+vertindexoffset);
-        m_indices.push_back(face->mIndices[1]+vertindexoffset);
-        m_indices.push_back(face->mIndices[2]+vertindexoffset);
     }
 
-    newMesh->indexCount = m_indices.size() - indexCountBefore;
-    newMesh->material = m_materials.at(mesh->mMaterialIndex);
-
     return newMesh;
 }
 
@@ -346,18 +803,20 @@ void ModelLoader::processNode(const aiScene *scene, aiNode *node, Node *parentNo
         }
     }
 
-    qDebug() << "NodeName" << newNode.name;
-    qDebug() << "  NodeIndex" << nodeIndex;
-    qDebug() << "  NumChildren" << node->mNumChildren;
-    qDebug() << "  NumMeshes" << newNode.meshes.size();
-    for (int ii=0; ii<newNode.meshes.size(); ++ii) {
-        qDebug() << "    MeshName" << newNode.meshes[ii]->name;
-        qDebug() << "    MaterialName" << newNode.meshes[ii]->material->Name;
-        qDebug() << "    MeshVertices" << newNode.meshes[ii]->indexCount;
-        qDebug() << "    numUVChannels" << newNode.meshes[ii]->numUVChannels;
-        qDebug() << "    hasTangAndBit" << newNode.meshes[ii]->hasTangentsAndBitangents;
-        qDebug() << "    hasNormals" << newNode.meshes[ii]->hasNormals;
-        qDebug() << "    hasBones" << newNode.meshes[ii]->hasBones;
+    if (m_importProfile == ImportFull) {
+        qDebug() << "NodeName" << newNode.name;
+        qDebug() << "  NodeIndex" << nodeIndex;
+        qDebug() << "  NumChildren" << node->mNumChildren;
+        qDebug() << "  NumMeshes" << newNode.meshes.size();
+        for (int ii=0; ii<newNode.meshes.size(); ++ii) {
+            qDebug() << "    MeshName" << newNode.meshes[ii]->name;
+            qDebug() << "    MaterialName" << newNode.meshes[ii]->material->Name;
+            qDebug() << "    MeshVertices" << newNode.meshes[ii]->indexCount;
+            qDebug() << "    numUVChannels" << newNode.meshes[ii]->numUVChannels;
+            qDebug() << "    hasTangAndBit" << newNode.meshes[ii]->hasTangentsAndBitangents;
+            qDebug() << "    hasNormals" << newNode.meshes[ii]->hasNormals;
+            qDebug() << "    hasBones" << newNode.meshes[ii]->hasBones;
+        }
     }
 
     ++nodeIndex;
@@ -371,61 +830,195 @@ void ModelLoader::processNode(const aiScene *scene, aiNode *node, Node *parentNo
 
 void ModelLoader::transformToUnitCoordinates()
 {
-    // This will transform the model to unit coordinates, so a model of any size or shape will fit on screen
-
-    double amin = std::numeric_limits<double>::max();
-    double amax = std::numeric_limits<double>::min();
-    QVector3D minDimension(amin,amin,amin);
-    QVector3D maxDimension(amax,amax,amax);
+    // This will transform the model to unit coordinates, so a model of any size or shape will fit on screen.
+    // The renderer draws the vertex buffer as it is, so the buffer itself is scaled and centered.
 
-    // Get the minimum and maximum x,y,z values for the model
-    findObjectDimensions(m_rootNode.data(), QMatrix4x4(), minDimension, maxDimension);
+    // Bounds of every mesh the nodes use, in the coordinates of the vertex buffer
+    const QVector3D minDimension = m_rootNode->boundsMin;
+    const QVector3D maxDimension = m_rootNode->boundsMax;
 
     // Calculate scale and translation needed to center and fit on screen
     float dist = qMax(maxDimension.x() - minDimension.x(), qMax(maxDimension.y()-minDimension.y(), maxDimension.z() - minDimension.z()));
-    float sc = 1.0/dist;
-    QVector3D center = (maxDimension - minDimension)/2;
-    QVector3D trans = -(maxDimension - center);
-
-    // Apply the scale and translation to a matrix
-    QMatrix4x4 transformation;
-    transformation.setToIdentity();
-    transformation.scale(sc);
-    transformation.translate(trans);
-
-    // Multiply the transformation to the root node transformation matrix
-    m_rootNode.data()->transformation = transformation * m_rootNode.data()->transformation;
+    if (!(dist > 0.f))
+        return;
+
+    const float sc = 1.0/dist;
+    const QVector3D center = (maxDimension + minDimension)/2;
+
+    float *vertices = m_vertices.data();
+    for(int ii=0; ii<m_vertices.size(); ii += 3)
+    {
+        vertices[ii] = (vertices[ii] - center.x()) * sc;
+        vertices[ii+1] = (vertices[ii+1] - center.y()) * sc;
+        vertices[ii+2] = (vertices[ii+2] - center.z()) * sc;
+    }
+
+    // Normals keep their direction under a uniform scale, bounds and
+    // simplification errors move with the vertices
+    for(int ii=0; ii<m_meshes.size(); ++ii)
+    {
+        Mesh &mesh = *m_meshes[ii];
+        if(mesh.boundsMin.x() > mesh.boundsMax.x())
+            continue;
+
+        mesh.boundsMin = (mesh.boundsMin - center) * sc;
+        mesh.boundsMax = (mesh.boundsMax - center) * sc;
+
+        for(int il=0; il<mesh.levels.size(); ++il)
+            mesh.levels[il].error *= sc;
+    }
+
+    findNodeBounds(*m_rootNode);
 }
 
-void ModelLoader::findObjectDimensions(Node *node, QMatrix4x4 transformation, QVector3D &minDimension, QVector3D &maxDimension)
+void ModelLoader::findNodeBounds(Node &node)
 {
-    transformation *= node->transformation;
+    double amin = std::numeric_limits<double>::max();
+    double amax = -std::numeric_limits<double>::max();
+    node.boundsMin = QVector3D(amin,amin,amin);
+    node.boundsMax = QVector3D(amax,amax,amax);
+
+    for (int ii=0; ii<node.meshes.size(); ++ii) {
+        const Mesh &mesh = *node.meshes[ii];
+        node.boundsMin = QVector3D(qMin(node.boundsMin.x(), mesh.boundsMin.x()), qMin(node.boundsMin.y(), mesh.boundsMin.y()), qMin(node.boundsMin.z(), mesh.boundsMin.z()));
+        node.boundsMax = QVector3D(qMax(node.boundsMax.x(), mesh.boundsMax.x()), qMax(node.boundsMax.y(), mesh.boundsMax.y()), qMax(node.boundsMax.z(), mesh.boundsMax.z()));
+    }
+
+    for (int ii=0; ii<node.nodes.size(); ++ii) {
+        Node &child = node.nodes[ii];
+        findNodeBounds(child);
+        node.boundsMin = QVector3D(qMin(node.boundsMin.x(), child.boundsMin.x()), qMin(node.boundsMin.y(), child.boundsMin.y()), qMin(node.boundsMin.z(), child.boundsMin.z()));
+        node.boundsMax = QVector3D(qMax(node.boundsMax.x(), child.boundsMax.x()), qMax(node.boundsMax.y(), child.boundsMax.y()), qMax(node.boundsMax.z(), child.boundsMax.z()));
+    }
+}
+
+void ModelLoader::buildLevelsOfDetail()
+{
+    // Smaller meshes are cheap enough to draw in full at any distance
+    const int minTriangles = 512;
+
+    QVector<QVector<QVector<unsigned int> > > levelIndices(m_meshes.size());
+
+    // Meshes are independent, the largest ones take by far the longest
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(int ii=0; ii<m_meshes.size(); ++ii)
+    {
+        Mesh &mesh = *m_meshes.at(ii);
+        int triangles = mesh.indexCount / 3;
+        if(triangles <= minTriangles)
+            continue;
+
+        MeshSimplifier simplifier(m_vertices.constData(), m_indices.constData() + mesh.indexOffset, mesh.indexCount);
+
+        while(triangles > minTriangles)
+        {
+            simplifier.simplify(triangles / 2);
+
+            // Nothing much left that can collapse without tearing or folding the surface
+            if(simplifier.triangleCount() > triangles * 3 / 4)
+                break;
+
+            triangles = simplifier.triangleCount();
+            levelIndices[ii].push_back(simplifier.indices());
 
-    for (int ii=0; ii<node->meshes.size(); ++ii) {
-        int start = node->meshes[ii]->indexOffset;
-        int end = start + node->meshes[ii]->indexCount;
-        for(int ii=start; ii<end; ++ii)
+            MeshLevel level;
+            level.indexCount = triangles * 3;
+            level.indexOffset = 0;
+            level.error = simplifier.error();
+            mesh.levels.push_back(level);
+        }
+    }
+
+    for(int ii=0; ii<m_meshes.size(); ++ii)
+    {
+        Mesh &mesh = *m_meshes[ii];
+        for(int il=0; il<mesh.levels.size(); ++il)
         {
-            int ind = m_indices[ii] * 3;
-            QVector4D vec(m_vertices[ind], m_vertices[ind+1], m_vertices[ind+2], 1.0);
-            vec = transformation * vec;
-
-            if(vec.x() < minDimension.x())
-                minDimension.setX(vec.x());
-            if(vec.y() < minDimension.y())
-                minDimension.setY(vec.y());
-            if(vec.z() < minDimension.z())
-                minDimension.setZ(vec.z());
-            if(vec.x() > maxDimension.x())
-                maxDimension.setX(vec.x());
-            if(vec.y() > maxDimension.y())
-                maxDimension.setY(vec.y());
-            if(vec.z() > maxDimension.z())
-                maxDimension.setZ(vec.z());
+            mesh.levels[il].indexOffset = m_levelIndices.size();
+            m_levelIndices += levelIndices[ii][il];
         }
+
+        if(m_importProfile == ImportFull && !mesh.levels.isEmpty())
+            qDebug() << "Mesh" << mesh.name << "levels of detail" << mesh.levels.size()
+                     << "coarsest triangles" << mesh.levels.last().indexCount / 3;
+    }
+}
+
+namespace
+{
+    // Moves the vertex at first + i to first + order[i]. Buffers not covering
+    // the range, like normals of a model without any, are left alone.
+    void permuteVertices(QVector<float> &buffer, int components, int first, const QVector<int> &order)
+    {
+        const int count = order.size() * components;
+        if(buffer.size() < first * components + count)
+            return;
+
+        float *data = buffer.data() + first * components;
+        const std::vector<float> copy(data, data + count);
+
+        for(int ii=0; ii<order.size(); ++ii)
+            std::copy(copy.begin() + ii * components, copy.begin() + (ii + 1) * components, data + order[ii] * components);
     }
+}
+
+void ModelLoader::optimizeVertexOrder()
+{
+    double missesBefore = 0.0;
+    double missesAfter = 0.0;
+    double triangles = 0.0;
+
+    // Meshes own disjoint vertex ranges, so they are reordered independently
+    #pragma omp parallel for schedule(dynamic, 1) reduction(+:missesBefore,missesAfter,triangles)
+    for(int ii=0; ii<m_meshes.size(); ++ii)
+    {
+        Mesh &mesh = *m_meshes.at(ii);
+        const int vertexCount = mesh.vertexCount;
+        if(vertexCount == 0 || mesh.indexCount == 0)
+            continue;
+
+        // The full resolution triangles first, then those of every level of detail
+        QVector<unsigned int *> ranges;
+        QVector<int> counts;
+        ranges.push_back(m_indices.data() + mesh.indexOffset);
+        counts.push_back(mesh.indexCount);
+        for(int il=0; il<mesh.levels.size(); ++il)
+        {
+            ranges.push_back(m_levelIndices.data() + mesh.levels[il].indexOffset);
+            counts.push_back(mesh.levels[il].indexCount);
+        }
+
+        for(int ir=0; ir<ranges.size(); ++ir)
+        {
+            for(int ind=0; ind<counts[ir]; ++ind)
+                ranges[ir][ind] -= mesh.vertexOffset;
+        }
 
-    for (int ii=0; ii<node->nodes.size(); ++ii) {
-        findObjectDimensions(&(node->nodes[ii]), transformation, minDimension, maxDimension);
+        missesBefore += MeshOptimizer::averageCacheMissRatio(ranges[0], counts[0], vertexCount) * (counts[0] / 3);
+
+        for(int ir=0; ir<ranges.size(); ++ir)
+            MeshOptimizer::optimizeVertexCache(ranges[ir], counts[ir], vertexCount);
+
+        missesAfter += MeshOptimizer::averageCacheMissRatio(ranges[0], counts[0], vertexCount) * (counts[0] / 3);
+        triangles += counts[0] / 3;
+
+        // Vertex data in the order the full resolution triangles read it
+        const QVector<int> order = MeshOptimizer::firstUseOrder(ranges[0], counts[0], vertexCount);
+
+        for(int ir=0; ir<ranges.size(); ++ir)
+        {
+            for(int ind=0; ind<counts[ir]; ++ind)
+                ranges[ir][ind] = order[ranges[ir][ind]] + mesh.vertexOffset;
+        }
+
+        permuteVertices(m_vertices, 3, mesh.vertexOffset, order);
+        permuteVertices(m_normals, 3, mesh.vertexOffset, order);
+        permuteVertices(m_tangents, 3, mesh.vertexOffset, order);
+        permuteVertices(m_bitangents, 3, mesh.vertexOffset, order);
+        for(int mchanInd=0; mchanInd<m_textureUV.size(); ++mchanInd)
+            permuteVertices(m_textureUV[mchanInd], m_numUVComponents[mchanInd], mesh.vertexOffset, order);
     }
+
+    if(m_importProfile == ImportFull && triangles > 0.0)
+        qDebug() << "Average vertex cache miss ratio" << missesBefore / triangles << "->" << missesAfter / triangles;
 }
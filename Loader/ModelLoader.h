@@ -7,6 +7,7 @@
 #include <QFile>
 #include <QSharedPointer>
 #include <QDir>
+#include <QFileInfo>
 
 struct aiScene;
 struct aiNode;
@@ -14,6 +15,8 @@ struct aiMesh;
 struct aiMaterial;
 
 namespace SpanningScanline {
+	class Texture;
+
 	struct MaterialInfo
 	{
 		QString Name;
@@ -24,6 +27,7 @@ namespace SpanningScanline {
 
 		bool isTexture;
 		QString textureName;
+		QSharedPointer<Texture> texture;	// Loaded with its mip chain, null if the file could not be read
 	};
 
 	struct LightInfo
@@ -32,13 +36,33 @@ namespace SpanningScanline {
 		QVector3D Intensity;
 	};
 
+	// A simplified version of a mesh. Its triangles index the same vertices
+	// as the full resolution mesh.
+	struct MeshLevel
+	{
+		unsigned int indexCount;
+		unsigned int indexOffset;
+		float error;	// Furthest the surface moved, in the coordinates of the vertex buffer
+	};
+
 	struct Mesh
 	{
 		QString name;
 		unsigned int indexCount;
 		unsigned int indexOffset;
+		unsigned int vertexCount;
+		unsigned int vertexOffset;
 		QSharedPointer<MaterialInfo> material;
 
+		// Axis aligned bounding box, in the coordinates of the vertex buffer
+		QVector3D boundsMin;
+		QVector3D boundsMax;
+
+		// Coarser levels of detail, each with about half the triangles of the
+		// one before. Their offsets are into the level index buffer, see
+		// ModelLoader::getLevelIndices(). Empty for small meshes.
+		QVector<MeshLevel> levels;
+
 		unsigned int numUVChannels;
 		bool hasTangentsAndBitangents;
 		bool hasNormals;
@@ -52,6 +76,12 @@ namespace SpanningScanline {
 		QMatrix4x4 transformation;
 		QVector<QSharedPointer<Mesh> > meshes;
 		QVector<Node> nodes;
+
+		// Bounds of every mesh in this subtree, in the coordinates of the vertex
+		// buffer (the renderer draws the buffer without node transformations).
+		// Empty subtrees have boundsMin > boundsMax.
+		QVector3D boundsMin;
+		QVector3D boundsMax;
 	};
 
 	class ModelLoader
@@ -62,14 +92,44 @@ namespace SpanningScanline {
 			AbsolutePath
 		};
 
+		enum ImportProfile {
+			ImportFull,			// Everything assimp offers: tangent space, every uv channel, diagnostic logging
+			ImportRenderOnly	// Positions, normals, indices and the first uv channel, only warnings and errors logged
+		};
+
+		// transformToUnitCoordinates scales and centers the vertex buffer after
+		// loading, so the model fits the unit cube around the origin
 		ModelLoader(bool transformToUnitCoordinates = true);
 
 		static std::string getSupportedTypes();
 
+		// On by default: load() simplifies every large mesh into a chain of
+		// levels of detail, see Mesh::levels
+		void setBuildLevelsOfDetail(bool enabled) { m_buildLevelsOfDetail = enabled; }
+
+		// Off by default. Reorders every mesh's triangles so consecutive ones
+		// share vertices, and its vertices in the order the triangles use them,
+		// so setup reads the buffers mostly front to back. With ImportFull,
+		// load() then logs the average vertex cache miss ratio before and after.
+		void setOptimizeVertexOrder(bool enabled) { m_optimizeVertexOrder = enabled; }
+
+		// load() keeps a binary copy of every model it imports in this
+		// directory, and loads an unchanged file from there instead of running
+		// assimp again. A subdirectory of the user's cache location by default,
+		// an empty path disables the cache.
+		void setCacheDirectory(const QString &directory) { m_cacheDirectory = directory; }
+
+		// ImportFull by default. Takes effect with the next load().
+		void setImportProfile(ImportProfile profile) { m_importProfile = profile; }
+
 		bool load(QString filePath, PathType pathType);
 		void getBufferData(QVector<float> **vertices, QVector<float> **normals,
 			QVector<unsigned int> **indices);
 
+		// Triangles of every mesh's levels of detail, kept apart from the full
+		// resolution ones getBufferData() returns. Empty without levels.
+		const QVector<unsigned int> &getLevelIndices() const { return m_levelIndices; }
+
 		void getTextureData(QVector<QVector<float> > **textureUV,                   // For texture mapping
 			QVector<float> **tangents, QVector<float> **bitangents);// For normal mapping
 
@@ -79,16 +139,31 @@ namespace SpanningScanline {
 		int numUVChannels() { return m_textureUV.size(); }
 		int numUVComponents(int channel) { return m_numUVComponents.at(channel); }
 	private:
+		bool importScene(const QString &filePath, unsigned int importFlags);
+		void clear();
+
+		// Cache files are keyed on the source's path, modification time and
+		// size, the import flags and profile, and whether levels of detail are
+		// built and vertices reordered
+		QString cacheFilePath(const QFileInfo &source) const;
+		bool readCache(const QString &cachePath, const QFileInfo &source, unsigned int importFlags);
+		bool writeCache(const QString &cachePath, const QFileInfo &source, unsigned int importFlags) const;
+
 		QSharedPointer<MaterialInfo> processMaterial(aiMaterial *mater);
-		QSharedPointer<Mesh> processMesh(aiMesh *mesh);
+		void processMeshes(const aiScene *scene);
+		unsigned int importedUVChannels(const aiMesh *mesh) const;
+		QSharedPointer<Mesh> processMesh(aiMesh *mesh, unsigned int vertexOffset, unsigned int indexOffset, unsigned int indexCount);
 		void processNode(const aiScene *scene, aiNode *node, Node *parentNode, Node &newNode);
 
 		void transformToUnitCoordinates();
-		void findObjectDimensions(Node *node, QMatrix4x4 transformation, QVector3D &minDimension, QVector3D &maxDimension);
+		void findNodeBounds(Node &node);
+		void buildLevelsOfDetail();
+		void optimizeVertexOrder();
 
 		QVector<float> m_vertices;
 		QVector<float> m_normals;
 		QVector<unsigned int> m_indices;
+		QVector<unsigned int> m_levelIndices;
 
 		QVector<QVector<float/*texture mapping coords*/> > m_textureUV; // m_textureUV[uvChannelIndex] is vector of texture mapping coords
 																		// m_textureUV[uvChannelIndex][ii+n] == if(n==0&&numCmpnts>0) U; if(n==0&&numCmpnts>0) V; if(n==0&&numCmpnts>0) W.
@@ -100,6 +175,10 @@ namespace SpanningScanline {
 		QVector<QSharedPointer<Mesh> > m_meshes;
 		QSharedPointer<Node> m_rootNode;
 		bool m_transformToUnitCoordinates;
+		bool m_buildLevelsOfDetail;
+		bool m_optimizeVertexOrder;
+		ImportProfile m_importProfile;
+		QString m_cacheDirectory;
 	};
 }
 
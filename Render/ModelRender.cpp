@@ -1,12 +1,380 @@
 #include "ModelRender.h"
+#include "Texture.h"
+#include "Loader/ModelLoader.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SPANNING_SCANLINE_SSE
+#include <emmintrin.h>
+
+// AVX2 is only compiled in, whether it is used is decided at runtime
+#if defined(_MSC_VER) || defined(__GNUC__)
+#define SPANNING_SCANLINE_AVX2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+#endif
+
+namespace {
+	// Clip space planes a vertex can be outside of
+	enum Outcode {
+		OutsideLeft = 0x01,
+		OutsideRight = 0x02,
+		OutsideBottom = 0x04,
+		OutsideTop = 0x08,
+		OutsideNear = 0x10,
+		OutsideFar = 0x20,
+		OutsideGuardBand = 0x40
+	};
+
+	// Polygons reaching further than this many half viewports off-screen get
+	// clipped, anything closer is left to the scanlines and drawLine().
+	const float kGuardBand = 2.f;
+
+	// A triangle clipped against the near plane and the four guard band planes
+	const int kMaxClippedVertices = 3 + 5;
+
+	const unsigned char kOutsideFrustum = OutsideLeft | OutsideRight | OutsideBottom | OutsideTop | OutsideNear | OutsideFar;
+
+	unsigned char clipOutcode(const float *clip)
+	{
+		unsigned char code = 0;
+		if (clip[0] < -clip[3]) code |= OutsideLeft;
+		if (clip[0] > clip[3]) code |= OutsideRight;
+		if (clip[1] < -clip[3]) code |= OutsideBottom;
+		if (clip[1] > clip[3]) code |= OutsideTop;
+		if (clip[2] < -clip[3]) code |= OutsideNear;
+		if (clip[2] > clip[3]) code |= OutsideFar;
+
+		const float guardW = clip[3] * kGuardBand;
+		if (clip[0] < -guardW || clip[0] > guardW || clip[1] < -guardW || clip[1] > guardW) code |= OutsideGuardBand;
+
+		return code;
+	}
+
+	typedef void (*FillSpanFunction)(QRgb *pixels, int count, QRgb color);
+
+#ifndef SPANNING_SCANLINE_SSE
+	void fillSpanScalar(QRgb *pixels, int count, QRgb color)
+	{
+		for (int i = 0; i < count; i++) {
+			pixels[i] = color;
+		}
+	}
+#else
+	void fillSpanSSE2(QRgb *pixels, int count, QRgb color)
+	{
+		const __m128i c = _mm_set1_epi32(int(color));
+
+		int i = 0;
+		for (; i + 4 <= count; i += 4) {
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(pixels + i), c);
+		}
+		for (; i < count; i++) {
+			pixels[i] = color;
+		}
+	}
+#endif
+
+#ifdef SPANNING_SCANLINE_AVX2
+#ifdef __GNUC__
+	__attribute__((target("avx2")))
+#endif
+	void fillSpanAVX2(QRgb *pixels, int count, QRgb color)
+	{
+		const __m256i c = _mm256_set1_epi32(int(color));
+
+		int i = 0;
+		for (; i + 8 <= count; i += 8) {
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(pixels + i), c);
+		}
+		for (; i < count; i++) {
+			pixels[i] = color;
+		}
+	}
+
+	bool cpuSupportsAVX2()
+	{
+#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7) {
+			return false;
+		}
+
+		// The OS has to save the YMM registers too
+		__cpuid(info, 1);
+		const bool osSavesAVX = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 0x6) == 0x6;
+		if (!osSavesAVX) {
+			return false;
+		}
+
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+#else
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2") != 0;
+#endif
+	}
+#endif
+
+	FillSpanFunction selectFillSpan()
+	{
+#ifdef SPANNING_SCANLINE_AVX2
+		if (cpuSupportsAVX2()) {
+			return fillSpanAVX2;
+		}
+#endif
+#ifdef SPANNING_SCANLINE_SSE
+		return fillSpanSSE2;
+#else
+		return fillSpanScalar;
+#endif
+	}
+
+	// Picked once, when the program starts
+	const FillSpanFunction fillSpan = selectFillSpan();
+
+	// Side x is stepped in 16.16 fixed point when asked for. Values are
+	// clamped so that x plus delta_x cannot overflow.
+	const float kFixedOne = 65536.f;
+	const float kFixedToFloat = 1.f / 65536.f;
+	const float kMaxFixedValue = 16383.f;
+
+	int toFixed(double v)
+	{
+		return qRound(qBound(-double(kMaxFixedValue), v, double(kMaxFixedValue)) * kFixedOne);
+	}
+
+	void growActiveSides(SpanningScanline::ActiveSideList &sides, int size)
+	{
+		if (sides.x.size() >= size) {
+			return;
+		}
+
+		size = max(size, sides.x.size() * 2);
+		sides.x.resize(size);
+		sides.deltaX.resize(size);
+		sides.fixedX.resize(size);
+		sides.fixedDeltaX.resize(size);
+		sides.crossY.resize(size);
+		sides.polygonId.resize(size);
+	}
+
+	void setActiveSide(SpanningScanline::ActiveSideList &sides, int i, const SpanningScanline::Side &side,
+		float firstX, int steps, bool fixedPoint)
+	{
+		sides.deltaX[i] = side.delta_x;
+		sides.crossY[i] = side.cross_y;
+		sides.polygonId[i] = side.polygon_id;
+
+		if (fixedPoint) {
+			// Exactly what stepping from the first scanline would give
+			sides.fixedDeltaX[i] = toFixed(side.delta_x);
+			sides.fixedX[i] = toFixed(firstX + double(steps) * sides.fixedDeltaX[i] * kFixedToFloat);
+			sides.x[i] = sides.fixedX[i] * kFixedToFloat;
+		}
+		else {
+			sides.x[i] = side.x;
+		}
+	}
+
+	void copyActiveSide(const SpanningScanline::ActiveSideList &from, int i, SpanningScanline::ActiveSideList &to, int j,
+		bool fixedPoint)
+	{
+		to.x[j] = from.x[i];
+		to.deltaX[j] = from.deltaX[i];
+		to.crossY[j] = from.crossY[i];
+		to.polygonId[j] = from.polygonId[i];
+
+		if (fixedPoint) {
+			to.fixedX[j] = from.fixedX[i];
+			to.fixedDeltaX[j] = from.fixedDeltaX[i];
+		}
+	}
+
+	// The light sits at the camera, so the half vector is the view vector and
+	// one cosine gives both the diffuse and the specular term.
+	void lightColor(float cosine, const SpanningScanline::ShadingMaterial &material, float *rgb)
+	{
+		cosine = max(cosine, 0.f);
+		const float highlight = material.shininess > 0.f && cosine > 0.f ? std::pow(cosine, material.shininess) : 0.f;
+
+		for (int c = 0; c < 3; c++) {
+			rgb[c] = material.ambient[c] + material.diffuse[c] * cosine + material.specular[c] * highlight;
+		}
+	}
+
+	// An attribute of the triangle's corners at a polygon vertex
+	QVector3D interpolate(const QVector3D *attributes, const QVector3D &weights)
+	{
+		return attributes[0] * weights.x() + attributes[1] * weights.y() + attributes[2] * weights.z();
+	}
+
+	// Fits value(x, y) to the values at three polygon vertices. area is twice
+	// the signed window area of the three vertices.
+	void fitShadingPlane(const QVector3D *const *v, float area, const QVector3D *value, SpanningScanline::ShadingPlane &plane)
+	{
+		const float x1 = v[1]->x() - v[0]->x(), y1 = v[1]->y() - v[0]->y();
+		const float x2 = v[2]->x() - v[0]->x(), y2 = v[2]->y() - v[0]->y();
+
+		for (int c = 0; c < 3; c++) {
+			const float a1 = value[1][c] - value[0][c];
+			const float a2 = value[2][c] - value[0][c];
+
+			plane.dx[c] = area != 0.f ? (a1 * y2 - a2 * y1) / area : 0.f;
+			plane.dy[c] = area != 0.f ? (a2 * x1 - a1 * x2) / area : 0.f;
+			plane.origin[c] = value[0][c] - plane.dx[c] * v[0]->x() - plane.dy[c] * v[0]->y();
+		}
+	}
+
+	QRgb packColor(const float *rgb)
+	{
+		return qRgb(int(qBound(0.f, rgb[0], 255.f)), int(qBound(0.f, rgb[1], 255.f)), int(qBound(0.f, rgb[2], 255.f)));
+	}
+
+	// Texture coordinates are divided by w exactly every this many pixels
+	// and interpolated linearly in between
+	const int kTextureStep = 16;
+
+	// Integral of the part of a pixel right of a vertical line, for a line u
+	// pixels into it: the whole pixel left of it, none right of it
+	float coveredIntegral(float u)
+	{
+		if (u <= 0.f) {
+			return u;
+		}
+		return u < 1.f ? u - u * u * 0.5f : 0.5f;
+	}
+
+	// The part of pixel x right of a side, which moves linearly from lo to hi
+	// down the scanline. Averaged over that range, so exact for the trapezoid.
+	float areaRightOf(const SpanningScanline::EdgeRamp &edge, int x)
+	{
+		const float width = edge.hi - edge.lo;
+		if (width < 1e-3f) {
+			return qBound(0.f, x + 1 - edge.x, 1.f);
+		}
+		return (coveredIntegral(edge.hi - x) - coveredIntegral(edge.lo - x)) / width;
+	}
+
+	// Rows with at most this many ascending runs are merged, the rest sorted
+	const int kMaxSortRuns = 16;
+
+	// Sides starting at the same vertex in the order they fan out, which
+	// only anti-aliasing tells apart
+	bool sideBefore(const SpanningScanline::Side &a, const SpanningScanline::Side &b)
+	{
+		return a.x < b.x || (a.x == b.x && a.delta_x < b.delta_x);
+	}
+
+	// Sorts a row laid out in last frame's order by merging its ascending runs.
+	// Sides that stayed in the row form one run, sides that moved in from the
+	// rows above or below one run each. Returns the comparisons spent, or -1
+	// without touching the row if it has more than kMaxSortRuns runs.
+	int mergeSortedRuns(SpanningScanline::Side *begin, SpanningScanline::Side *end)
+	{
+		SpanningScanline::Side *runs[kMaxSortRuns + 1];
+		int runCount = 0;
+
+		runs[runCount++] = begin;
+		for (SpanningScanline::Side *i = begin + 1; i < end; i++) {
+			if (sideBefore(*i, *(i - 1))) {
+				if (runCount == kMaxSortRuns) {
+					return -1;
+				}
+				runs[runCount++] = i;
+			}
+		}
+		runs[runCount] = end;
+
+		int work = int(end - begin) - 1;
+
+		while (runCount > 1) {
+			int merged = 0;
+			for (int r = 0; r < runCount; r += 2) {
+				if (r + 1 < runCount) {
+					std::inplace_merge(runs[r], runs[r + 1], runs[r + 2], sideBefore);
+				}
+				runs[merged++] = runs[r];
+			}
+			runs[merged] = end;
+			runCount = merged;
+			work += int(end - begin);
+		}
+
+		return work;
+	}
+
+#ifndef QT_NO_DEBUG
+	// Whether a row is in the order a full sort would put it in. Sides
+	// neither one sorts before the other may be in any order.
+	bool matchesFullSort(const SpanningScanline::Side *begin, const SpanningScanline::Side *end)
+	{
+		QVector<SpanningScanline::Side> sorted(int(end - begin));
+		std::copy(begin, end, sorted.begin());
+		std::sort(sorted.begin(), sorted.end(), sideBefore);
+
+		for (int i = 0; i < sorted.size(); i++) {
+			if (sideBefore(begin[i], sorted[i]) || sideBefore(sorted[i], begin[i])) {
+				return false;
+			}
+		}
+
+		return true;
+	}
+#endif
+
+	// Comparisons a comparison sort needs for n elements, roughly
+	qint64 fullSortCost(int n)
+	{
+		return qint64(n * std::log2(double(n)));
+	}
+
+	// Milliseconds since the last lap, restarts the timer. A timer that was
+	// never started (statistics are off) always reads 0.
+	double lapTime(QElapsedTimer &timer)
+	{
+		if (!timer.isValid()) {
+			return 0.0;
+		}
+
+		const double ms = timer.nsecsElapsed() / 1e6;
+		timer.restart();
+		return ms;
+	}
+}
 
 SpanningScanline::ModelRender::ModelRender(QRgb backgroundColor) :
 	m_backgroundColor(backgroundColor),
 	m_max_z(100.f),
-	m_frame_buffer(0),
+	m_threadCount(0),
+	m_cullMode(CullAll),
+	m_statsEnabled(false),
+	m_coverageComplete(true),
+	m_fixedPointEdges(false),
+	m_temporalCoherence(false),
+	m_shadingMode(ShadeFlat),
+	m_antiAliasing(false),
+	m_levelOfDetailError(1.f),
+	m_bandHeight(0),
+	m_backImage(0),
+	m_frameBits(0),
+	m_frameStride(0),
 	m_width(0),
 	m_height(0)
 {
+	m_stats = RenderStats();
+	m_sideRowStart.fill(0, 1);	// an empty table of zero rows
 }
 
 void SpanningScanline::ModelRender::setBufferData(const QVector<float> &vertices, const QVector<float> &normals, const QVector<unsigned int> &indices)
@@ -16,326 +384,1631 @@ void SpanningScanline::ModelRender::setBufferData(const QVector<float> &vertices
 	m_indices = QVector<unsigned int>(indices);
 }
 
-bool SpanningScanline::ModelRender::render()
+bool SpanningScanline::ModelRender::render()
+{
+	QElapsedTimer timer;
+	if (m_statsEnabled) {
+		timer.start();
+	}
+
+	if (!initialPolygonTableAndSideTable()) {
+		return false;
+	}
+
+	m_stats.setupTime = lapTime(timer);
+
+	sortSideTable();
+	seedBands();
+
+	m_stats.sideTableTime = lapTime(timer);
+
+	beginFrame();
+
+	// Otherwise scan() draws the background itself
+	if (!m_coverageComplete && !m_antiAliasing) {
+		initialFrameBuffer();
+	}
+
+	const int threads = threadCount();
+	const int bandCount = m_bands.size();
+
+	const bool statsEnabled = m_statsEnabled;
+
+	if (m_threadPolygonSlots.size() < threads) {
+		m_threadPolygonSlots.resize(threads);
+		m_threadActivePolygons.resize(threads);
+	}
+
+	#pragma omp parallel for schedule(dynamic) num_threads(threads)
+	for (int i = 0; i < bandCount; i++) {
+		if (statsEnabled) {
+			renderBand<true>(m_bands[i]);
+		}
+		else {
+			renderBand<false>(m_bands[i]);
+		}
+	}
+
+	for (const ScanlineBand &band : m_bands) {
+		m_stats.activeSideSwaps += band.sideSwaps;
+
+		if (statsEnabled) {
+			m_stats.peakActiveSides = max(m_stats.peakActiveSides, band.peakActiveSides);
+			m_stats.spans += band.spans;
+			m_stats.resolvedSpans += band.resolvedSpans;
+			m_stats.depthEvaluations += band.depthEvaluations;
+		}
+	}
+
+	m_stats.scanTime = lapTime(timer);
+
+	presentFrame();
+
+	return true;
+}
+
+QImage SpanningScanline::ModelRender::getRenderResult()
+{
+	return m_result;
+}
+
+void SpanningScanline::ModelRender::setCameraPos(const QVector3D &pos)
+{
+	m_camera_pos = pos;
+
+	m_modelview = QMatrix4x4();
+	m_modelview.lookAt(pos, QVector3D(0.f, 0.f, 0.f), QVector3D(0.f, 1.f, 0.f));
+}
+
+void SpanningScanline::ModelRender::setWindowSize(int width, int height)
+{
+	m_width = width;
+	m_height = height;
+
+	m_sideRowStart.fill(0, height + 1);
+	m_sideRowFill.resize(height);
+
+	// Allocated by the next beginFrame()
+	m_frameImages[0] = QImage();
+	m_frameImages[1] = QImage();
+	m_result = QImage();
+
+	m_projection = QMatrix4x4();
+	m_projection.perspective(70.0, float(width) / height, 0.1f, 100.f);
+
+	m_viewport = QRect(0, 0, width, height);
+
+	initialBands();
+}
+
+void SpanningScanline::ModelRender::setThreadCount(int count)
+{
+	m_threadCount = max(0, count);
+
+	initialBands();
+}
+
+bool SpanningScanline::ModelRender::initialPolygonTableAndSideTable()
+{
+	m_stats = RenderStats();
+
+	m_mvp = m_projection * m_modelview;
+
+	collectDrawRanges();
+
+	const int bufferVertexCount = m_vertices.size() / 3;
+	m_screenX.resize(bufferVertexCount);
+	m_screenY.resize(bufferVertexCount);
+	m_screenZ.resize(bufferVertexCount);
+	m_outcodes.resize(bufferVertexCount);
+
+	for (const DrawRange &range : m_drawRanges) {
+		transformVertices(range.firstVertex, range.vertexCount);
+	}
+
+	if (m_statsEnabled) {
+		for (const DrawRange &range : m_drawRanges) {
+			m_stats.submittedPolygons += range.indexCount / 3;
+		}
+	}
+
+	// Draw ranges one after the other, numbered by triangle
+	const int rangeCount = m_drawRanges.size();
+	m_drawRangeStart.resize(rangeCount + 1);
+	m_drawRangeStart[0] = 0;
+	for (int r = 0; r < rangeCount; r++) {
+		m_drawRangeStart[r + 1] = m_drawRangeStart[r] + m_drawRanges[r].indexCount / 3;
+	}
+	const int triangleCount = m_drawRangeStart[rangeCount];
+
+	// Triangles are set up in chunks of consecutive ones, joined in order
+	// afterwards, so the tables come out the same for any number of threads
+	const int minChunkTriangles = 1024;
+	const int threads = threadCount();
+	const int chunkCount = max(1, min(threads * 4, triangleCount / minChunkTriangles));
+
+	if (m_setupChunks.size() < chunkCount) {
+		m_setupChunks.resize(chunkCount);
+	}
+	TriangleSetup *chunks = m_setupChunks.data();
+
+	Polygon *polygons = 0;
+	PolygonShading *shading = 0;
+	Side *sides = 0;
+	int *sideRows = 0;
+
+	#pragma omp parallel num_threads(threads) if (chunkCount > 1)
+	{
+		#pragma omp for schedule(dynamic)
+		for (int k = 0; k < chunkCount; k++) {
+			const qint64 first = qint64(triangleCount) * k / chunkCount;
+			const qint64 last = qint64(triangleCount) * (k + 1) / chunkCount;
+			setupTriangles(chunks[k], int(first), int(last));
+		}
+
+		#pragma omp single
+		{
+			int polygonCount = 0, shadingCount = 0, sideCount = 0;
+			for (int k = 0; k < chunkCount; k++) {
+				TriangleSetup &chunk = chunks[k];
+				chunk.polygonBase = polygonCount;
+				chunk.shadingBase = shadingCount;
+				chunk.sideBase = sideCount;
+				polygonCount += chunk.polygons.size();
+				shadingCount += chunk.shading.size();
+				sideCount += chunk.sides.size();
+
+				m_stats.culledBackFace += chunk.culledBackFace;
+				m_stats.culledNearFar += chunk.culledNearFar;
+				m_stats.culledLeftRight += chunk.culledLeftRight;
+			}
+
+			// resize() keeps the capacity, after the first frames nothing is allocated
+			m_polygonTable.resize(polygonCount);
+			m_polygonShading.resize(shadingCount);
+			m_pendingSides.resize(sideCount);
+			m_pendingSideRows.resize(sideCount);
+			polygons = m_polygonTable.data();
+			shading = m_polygonShading.data();
+			sides = m_pendingSides.data();
+			sideRows = m_pendingSideRows.data();
+		}
+
+		// Polygon ids and shading indices were counted from each chunk's start
+		#pragma omp for schedule(static)
+		for (int k = 0; k < chunkCount; k++) {
+			const TriangleSetup &chunk = chunks[k];
+
+			Polygon *chunkPolygons = polygons + chunk.polygonBase;
+			for (int i = 0; i < chunk.polygons.size(); i++) {
+				chunkPolygons[i] = chunk.polygons[i];
+				chunkPolygons[i].id += chunk.polygonBase;
+				if (chunkPolygons[i].shading >= 0) {
+					chunkPolygons[i].shading += chunk.shadingBase;
+				}
+			}
+
+			std::copy(chunk.shading.constBegin(), chunk.shading.constEnd(), shading + chunk.shadingBase);
+
+			Side *chunkSides = sides + chunk.sideBase;
+			for (int i = 0; i < chunk.sides.size(); i++) {
+				chunkSides[i] = chunk.sides[i];
+				chunkSides[i].polygon_id += chunk.polygonBase;
+			}
+
+			std::copy(chunk.sideRows.constBegin(), chunk.sideRows.constEnd(), sideRows + chunk.sideBase);
+		}
+	}
+
+	bucketSideTable();
+
+	if (m_statsEnabled) {
+		m_stats.insertedPolygons = m_polygonTable.size();
+		m_stats.rejectedPolygons = m_stats.submittedPolygons - m_stats.insertedPolygons -
+			m_stats.culledBackFace - m_stats.culledNearFar - m_stats.culledLeftRight;
+		m_stats.sides = m_sideTable.size();
+	}
+
+	return true;
+}
+
+void SpanningScanline::ModelRender::setupTriangles(TriangleSetup &setup, int first, int last)
+{
+	setup.polygons.resize(0);
+	setup.shading.resize(0);
+	setup.sides.resize(0);
+	setup.sideRows.resize(0);
+	setup.culledBackFace = 0;
+	setup.culledNearFar = 0;
+	setup.culledLeftRight = 0;
+
+	QVector3D a, b, c, polygon_pos;
+	QVector3D a_normal, b_normal, c_normal, polygon_normal;
+	QVector3D polygon[kMaxClippedVertices];
+	QVector3D weights[kMaxClippedVertices];	// Of the triangle's corners, at every polygon vertex
+	int vertexCount = 0;
+	QVector3D view;
+	float factor = 0.f;
+
+	// The range the first triangle is in
+	int r = std::upper_bound(m_drawRangeStart.constBegin(), m_drawRangeStart.constEnd(), first) -
+		m_drawRangeStart.constBegin() - 1;
+
+	for (; first < last; r++) {
+		const DrawRange &range = m_drawRanges[r];
+		const int firstIndex = range.firstIndex + (first - m_drawRangeStart[r]) * 3;
+		const int lastIndex = range.firstIndex + (min(last, m_drawRangeStart[r + 1]) - m_drawRangeStart[r]) * 3;
+		first = min(last, m_drawRangeStart[r + 1]);
+
+		const bool textured = m_shadingMaterials[range.material].texture &&
+			m_textureUV.size() >= (range.firstVertex + range.vertexCount) * 2;
+		// Side ids of the levels' triangles follow those of the full
+		// resolution ones, so they never collide
+		const unsigned int *indices = range.level ? m_levelIndices.constData() : m_indices.constData();
+		const int idBase = range.level ? m_indices.size() : 0;
+
+		for (int i = firstIndex; i < lastIndex; i += 3) {
+			if (cullPolygon(setup, indices[i], indices[i + 1], indices[i + 2])) {
+				continue;
+			}
+
+			a = getVertexFromBuffer(indices[i]);
+			b = getVertexFromBuffer(indices[i + 1]);
+			c = getVertexFromBuffer(indices[i + 2]);
+
+			a_normal = getNormalFromBuffer(indices[i]);
+			b_normal = getNormalFromBuffer(indices[i + 1]);
+			c_normal = getNormalFromBuffer(indices[i + 2]);
+
+			// Get color factor by normal * view
+			polygon_pos = (a + b + c) / 3;
+			view = (m_camera_pos - polygon_pos).normalized();
+			polygon_normal = ((a_normal + b_normal + c_normal) / 3).normalized();
+			factor = QVector3D::dotProduct(polygon_normal, view);
+
+			const unsigned char outsideAny = m_outcodes[indices[i]] | m_outcodes[indices[i + 1]] | m_outcodes[indices[i + 2]];
+			if (outsideAny & (OutsideNear | OutsideGuardBand)) {
+				vertexCount = clipPolygon(indices[i], indices[i + 1], indices[i + 2], polygon, weights);
+			}
+			else {
+				polygon[0] = getProjectedVertex(indices[i]);
+				polygon[1] = getProjectedVertex(indices[i + 1]);
+				polygon[2] = getProjectedVertex(indices[i + 2]);
+				weights[0] = QVector3D(1.f, 0.f, 0.f);
+				weights[1] = QVector3D(0.f, 1.f, 0.f);
+				weights[2] = QVector3D(0.f, 0.f, 1.f);
+				vertexCount = 3;
+			}
+
+			const int polygon_id = setup.polygons.size();
+			if (addPolygon(setup, polygon, vertexCount, factor, polygon_id)) {
+				if (m_shadingMode != ShadeFlat || textured) {
+					addShading(setup, setup.polygons.last(), polygon, weights, vertexCount, indices + i,
+						range.material, textured);
+				}
+				addSides(setup, polygon, vertexCount, polygon_id, (idBase + i) / 3 * kMaxClippedVertices);
+			}
+		}
+	}
+}
+
+void SpanningScanline::ModelRender::collectDrawRanges()
+{
+	m_drawRanges.clear();
+	m_shadingMaterials.resize(0);
+
+	if (m_rootNode.isNull()) {
+		DrawRange range;
+		range.firstVertex = 0;
+		range.vertexCount = m_vertices.size() / 3;
+		range.firstIndex = 0;
+		range.indexCount = m_indices.size();
+		range.material = addShadingMaterial(0);
+		range.level = false;
+
+		m_drawRanges.push_back(range);
+		return;
+	}
+
+	m_collectedMeshes.clear();
+	collectDrawRanges(*m_rootNode, !(m_cullMode & CullHierarchy));
+}
+
+void SpanningScanline::ModelRender::collectDrawRanges(const Node &node, bool inside)
+{
+	if (node.boundsMin.x() > node.boundsMax.x()) {  // no meshes below this node
+		return;
+	}
+
+	// Once a node is entirely inside the frustum, so is everything below it
+	if (!inside) {
+		if (boundsOutcode(node.boundsMin, node.boundsMax, inside)) {
+			m_stats.culledNodes++;
+			return;
+		}
+	}
+
+	for (const QSharedPointer<Mesh> &mesh : node.meshes) {
+		if (m_collectedMeshes.contains(mesh.data())) {
+			continue;
+		}
+		m_collectedMeshes.insert(mesh.data());
+
+		bool meshInside = inside;
+		if (!meshInside && boundsOutcode(mesh->boundsMin, mesh->boundsMax, meshInside)) {
+			m_stats.culledMeshes++;
+			continue;
+		}
+
+		DrawRange range;
+		range.firstVertex = mesh->vertexOffset;
+		range.vertexCount = mesh->vertexCount;
+		range.firstIndex = mesh->indexOffset;
+		range.indexCount = mesh->indexCount;
+		range.material = addShadingMaterial(mesh->material.data());
+		range.level = false;
+
+		// Levels share the mesh's vertices, only the triangles change
+		if (m_levelOfDetailError > 0.f && !mesh->levels.isEmpty() && !m_levelIndices.isEmpty()) {
+			const float maxError = m_levelOfDetailError / pixelsPerUnit(mesh->boundsMin, mesh->boundsMax);
+
+			for (const MeshLevel &level : mesh->levels) {
+				if (level.error > maxError) {
+					break;
+				}
+				range.firstIndex = level.indexOffset;
+				range.indexCount = level.indexCount;
+				range.level = true;
+			}
+
+			if (range.level) {
+				m_stats.simplifiedMeshes++;
+			}
+		}
+
+		m_drawRanges.push_back(range);
+	}
+
+	for (const Node &child : node.nodes) {
+		collectDrawRanges(child, inside);
+	}
+}
+
+unsigned char SpanningScanline::ModelRender::boundsOutcode(const QVector3D &min, const QVector3D &max, bool &inside)
+{
+	unsigned char outsideAll = kOutsideFrustum;
+	unsigned char outsideAny = 0;
+
+	for (int i = 0; i < 8; i++) {
+		const QVector4D corner = m_mvp * QVector4D(i & 1 ? max.x() : min.x(), i & 2 ? max.y() : min.y(), i & 4 ? max.z() : min.z(), 1.f);
+		const float clip[4] = { corner.x(), corner.y(), corner.z(), corner.w() };
+		const unsigned char code = clipOutcode(clip);
+
+		outsideAll &= code;
+		outsideAny |= code;
+	}
+
+	inside = (outsideAny & kOutsideFrustum) == 0;
+
+	return outsideAll & kOutsideFrustum;
+}
+
+// Screen pixels per unit of the vertex buffer at the nearest corner of the
+// bounds, or infinity if the bounds reach the camera
+float SpanningScanline::ModelRender::pixelsPerUnit(const QVector3D &min, const QVector3D &max) const
+{
+	float nearest = std::numeric_limits<float>::max();
+
+	for (int i = 0; i < 8; i++) {
+		const QVector4D corner = m_modelview * QVector4D(i & 1 ? max.x() : min.x(), i & 2 ? max.y() : min.y(), i & 4 ? max.z() : min.z(), 1.f);
+		nearest = std::min(nearest, -corner.z());
+	}
+
+	if (nearest <= 0.f) {
+		return std::numeric_limits<float>::infinity();
+	}
+
+	return m_projection(1, 1) * m_viewport.height() * 0.5f / nearest;
+}
+
+void SpanningScanline::ModelRender::transformVertices(int first, int vertexCount)
+{
+	// Same mapping as QVector3D::project(), but done once per vertex instead
+	// of once per triangle corner.
+	float m[16];
+	for (int r = 0; r < 4; r++) {
+		for (int c = 0; c < 4; c++) {
+			m[r * 4 + c] = m_mvp(r, c);
+		}
+	}
+
+	const float halfWidth = m_viewport.width() * 0.5f;
+	const float halfHeight = m_viewport.height() * 0.5f;
+	const float centerX = m_viewport.x() + halfWidth;
+	const float centerY = m_viewport.y() + halfHeight;
+
+	const float *vertices = m_vertices.constData() + first * 3;
+	float *screenX = m_screenX.data() + first;
+	float *screenY = m_screenY.data() + first;
+	float *screenZ = m_screenZ.data() + first;
+	unsigned char *outcodes = m_outcodes.data() + first;
+
+	int simdCount = 0;
+
+#ifdef SPANNING_SCANLINE_SSE
+	simdCount = vertexCount & ~3;
+
+	#pragma omp parallel for schedule(static)
+	for (int i = 0; i < simdCount; i += 4) {
+		const float *v = vertices + i * 3;
+		const __m128 x = _mm_setr_ps(v[0], v[3], v[6], v[9]);
+		const __m128 y = _mm_setr_ps(v[1], v[4], v[7], v[10]);
+		const __m128 z = _mm_setr_ps(v[2], v[5], v[8], v[11]);
+
+		__m128 clip[4];
+		for (int r = 0; r < 4; r++) {
+			const float *row = m + r * 4;
+			clip[r] = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(row[0])), _mm_mul_ps(y, _mm_set1_ps(row[1]))),
+				_mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(row[2])), _mm_set1_ps(row[3])));
+		}
+
+		const __m128 negW = _mm_sub_ps(_mm_setzero_ps(), clip[3]);
+		const int outside[6] = {
+			_mm_movemask_ps(_mm_cmplt_ps(clip[0], negW)),
+			_mm_movemask_ps(_mm_cmpgt_ps(clip[0], clip[3])),
+			_mm_movemask_ps(_mm_cmplt_ps(clip[1], negW)),
+			_mm_movemask_ps(_mm_cmpgt_ps(clip[1], clip[3])),
+			_mm_movemask_ps(_mm_cmplt_ps(clip[2], negW)),
+			_mm_movemask_ps(_mm_cmpgt_ps(clip[2], clip[3]))
+		};
+		const __m128 guardW = _mm_mul_ps(clip[3], _mm_set1_ps(kGuardBand));
+		const __m128 negGuardW = _mm_sub_ps(_mm_setzero_ps(), guardW);
+		const int outsideGuardBand = _mm_movemask_ps(_mm_or_ps(
+			_mm_or_ps(_mm_cmplt_ps(clip[0], negGuardW), _mm_cmpgt_ps(clip[0], guardW)),
+			_mm_or_ps(_mm_cmplt_ps(clip[1], negGuardW), _mm_cmpgt_ps(clip[1], guardW))));
+
+		for (int lane = 0; lane < 4; lane++) {
+			unsigned char code = 0;
+			for (int plane = 0; plane < 6; plane++) {
+				code |= ((outside[plane] >> lane) & 1) << plane;
+			}
+			if ((outsideGuardBand >> lane) & 1) {
+				code |= OutsideGuardBand;
+			}
+			outcodes[i + lane] = code;
+		}
+
+		// Like project(), treat w close to zero as 1
+		const __m128 absW = _mm_and_ps(clip[3], _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff)));
+		const __m128 nullW = _mm_cmple_ps(absW, _mm_set1_ps(0.00001f));
+		const __m128 w = _mm_or_ps(_mm_andnot_ps(nullW, clip[3]), _mm_and_ps(nullW, _mm_set1_ps(1.f)));
+		const __m128 invW = _mm_div_ps(_mm_set1_ps(1.f), w);
+
+		const __m128 half = _mm_set1_ps(0.5f);
+		_mm_storeu_ps(screenX + i, _mm_add_ps(_mm_mul_ps(_mm_mul_ps(clip[0], invW), _mm_set1_ps(halfWidth)), _mm_set1_ps(centerX)));
+		_mm_storeu_ps(screenY + i, _mm_add_ps(_mm_mul_ps(_mm_mul_ps(clip[1], invW), _mm_set1_ps(halfHeight)), _mm_set1_ps(centerY)));
+		_mm_storeu_ps(screenZ + i, _mm_add_ps(_mm_mul_ps(_mm_mul_ps(clip[2], invW), half), half));
+	}
+#endif
+
+	for (int i = simdCount; i < vertexCount; i++) {
+		const float *v = vertices + i * 3;
+
+		float clip[4];
+		for (int r = 0; r < 4; r++) {
+			const float *row = m + r * 4;
+			clip[r] = (v[0] * row[0] + v[1] * row[1]) + (v[2] * row[2] + row[3]);
+		}
+
+		outcodes[i] = clipOutcode(clip);
+
+		const float w = std::abs(clip[3]) <= 0.00001f ? 1.f : clip[3];
+		const float invW = 1.f / w;
+
+		screenX[i] = clip[0] * invW * halfWidth + centerX;
+		screenY[i] = clip[1] * invW * halfHeight + centerY;
+		screenZ[i] = clip[2] * invW * 0.5f + 0.5f;
+	}
+}
+
+QVector3D SpanningScanline::ModelRender::getVertexFromBuffer(int index)
+{
+	int true_index = index * 3;
+	QVector3D vertex(m_vertices[true_index], m_vertices[true_index + 1], m_vertices[true_index + 2]);
+	return vertex;
+}
+
+QVector3D SpanningScanline::ModelRender::getNormalFromBuffer(int index)
+{
+	int true_index = index * 3;
+	QVector3D normal(m_normals[true_index], m_normals[true_index + 1], m_normals[true_index + 2]);
+	return normal;
+}
+
+QVector3D SpanningScanline::ModelRender::getProjectedVertex(int index)
+{
+	return QVector3D(m_screenX[index], m_screenY[index], m_screenZ[index]);
+}
+
+QVector4D SpanningScanline::ModelRender::getClipVertex(int index)
+{
+	return m_mvp * QVector4D(getVertexFromBuffer(index), 1.f);
+}
+
+QVector3D SpanningScanline::ModelRender::clipToWindow(const QVector4D &v)
+{
+	const float halfWidth = m_viewport.width() * 0.5f;
+	const float halfHeight = m_viewport.height() * 0.5f;
+
+	return QVector3D(v.x() / v.w() * halfWidth + m_viewport.x() + halfWidth,
+		v.y() / v.w() * halfHeight + m_viewport.y() + halfHeight,
+		v.z() / v.w() * 0.5f + 0.5f);
+}
+
+bool SpanningScanline::ModelRender::cullPolygon(TriangleSetup &setup, int a, int b, int c)
+{
+	const unsigned char outsideAll = m_outcodes[a] & m_outcodes[b] & m_outcodes[c];
+	const unsigned char outsideAny = m_outcodes[a] | m_outcodes[b] | m_outcodes[c];
+
+	if ((m_cullMode & CullNearFar) && (outsideAll & (OutsideNear | OutsideFar))) {
+		setup.culledNearFar++;
+		return true;
+	}
+
+	if ((m_cullMode & CullLeftRight) && (outsideAll & (OutsideLeft | OutsideRight))) {
+		setup.culledLeftRight++;
+		return true;
+	}
+
+	if (m_cullMode & CullBackFace) {
+		// Counter-clockwise in window coordinates is front facing
+		float area = 0.f;
+
+		if (outsideAny & OutsideNear) {
+			// Window coordinates behind the camera are meaningless, but the
+			// homogeneous determinant keeps the sign of the projected area.
+			const QVector4D pa = getClipVertex(a), pb = getClipVertex(b), pc = getClipVertex(c);
+			area = QVector3D::dotProduct(QVector3D(pa.x(), pa.y(), pa.w()),
+				QVector3D::crossProduct(QVector3D(pb.x(), pb.y(), pb.w()), QVector3D(pc.x(), pc.y(), pc.w())));
+		}
+		else {
+			area = (m_screenX[b] - m_screenX[a]) * (m_screenY[c] - m_screenY[a]) -
+				(m_screenX[c] - m_screenX[a]) * (m_screenY[b] - m_screenY[a]);
+		}
+
+		if (area <= 0.f) {
+			setup.culledBackFace++;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+int SpanningScanline::ModelRender::clipPolygon(int a, int b, int c, QVector3D *polygon, QVector3D *weights)
+{
+	// Sutherland-Hodgman in clip space, a vertex v is inside a plane p when
+	// dot(p, v) >= 0.
+	static const QVector4D planes[] = {
+		QVector4D(0.f, 0.f, 1.f, 1.f),			// Near
+		QVector4D(1.f, 0.f, 0.f, kGuardBand),	// Guard band left
+		QVector4D(-1.f, 0.f, 0.f, kGuardBand),	// Guard band right
+		QVector4D(0.f, 1.f, 0.f, kGuardBand),	// Guard band bottom
+		QVector4D(0.f, -1.f, 0.f, kGuardBand)	// Guard band top
+	};
+
+	QVector4D buffers[2][kMaxClippedVertices];
+	QVector4D *in = buffers[0], *out = buffers[1];
+	int inCount = 3;
+
+	in[0] = getClipVertex(a);
+	in[1] = getClipVertex(b);
+	in[2] = getClipVertex(c);
+
+	// Clipped along, so attributes can be interpolated at the new vertices
+	QVector3D weightBuffers[2][kMaxClippedVertices];
+	QVector3D *inWeights = weightBuffers[0], *outWeights = weightBuffers[1];
+
+	inWeights[0] = QVector3D(1.f, 0.f, 0.f);
+	inWeights[1] = QVector3D(0.f, 1.f, 0.f);
+	inWeights[2] = QVector3D(0.f, 0.f, 1.f);
+
+	for (const QVector4D &plane : planes) {
+		int outCount = 0;
+
+		for (int i = 0; i < inCount; i++) {
+			const QVector4D &cur = in[i];
+			const QVector4D &next = in[(i + 1) % inCount];
+			const float dCur = QVector4D::dotProduct(plane, cur);
+			const float dNext = QVector4D::dotProduct(plane, next);
+
+			if (dCur >= 0.f) {
+				outWeights[outCount] = inWeights[i];
+				out[outCount++] = cur;
+			}
+			if ((dCur >= 0.f) != (dNext >= 0.f)) {
+				// Exact entry point of the edge, no stepping needed
+				const float t = dCur / (dCur - dNext);
+				const QVector3D &nextWeights = inWeights[(i + 1) % inCount];
+				outWeights[outCount] = inWeights[i] + (nextWeights - inWeights[i]) * t;
+				out[outCount++] = cur + (next - cur) * t;
+			}
+		}
+
+		std::swap(in, out);
+		std::swap(inWeights, outWeights);
+		inCount = outCount;
+
+		if (inCount < 3) {
+			return 0;
+		}
+	}
+
+	for (int i = 0; i < inCount; i++) {
+		polygon[i] = clipToWindow(in[i]);
+		weights[i] = inWeights[i];
+	}
+
+	return inCount;
+}
+
+bool SpanningScanline::ModelRender::addPolygon(TriangleSetup &setup, const QVector3D *vertices, int vertexCount, float factor, int polygon_id)
+{
+	if (vertexCount < 3) {
+		return false;
+	}
+
+	float maxVertexY = vertices[0].y(), minVertexY = vertices[0].y();
+	for (int i = 1; i < vertexCount; i++) {
+		maxVertexY = std::max(maxVertexY, vertices[i].y());
+		minVertexY = std::min(minVertexY, vertices[i].y());
+	}
+
+	int maxY = (int)maxVertexY;
+	int minY = (int)minVertexY;
+
+	if (maxY < 0 || minY >= m_height) {  // totally out of screen
+		return false;
+	}
+
+	// Newell's method, robust for the slivers clipping can leave behind
+	QVector3D normal;
+	for (int i = 0; i < vertexCount; i++) {
+		const QVector3D &cur = vertices[i];
+		const QVector3D &next = vertices[(i + 1) % vertexCount];
+
+		normal += QVector3D((cur.y() - next.y()) * (cur.z() + next.z()),
+			(cur.z() - next.z()) * (cur.x() + next.x()),
+			(cur.x() - next.x()) * (cur.y() + next.y()));
+	}
+	normal.normalize();
+
+	if (normal.z() == 0) {
+		// printf("zero plane");
+		return false;
+	}
+
+	// Add to polygon table
+	const QVector3D &a = vertices[0];
+
+	Polygon p;
+	p.id = polygon_id;
+	p.a = normal.x();
+	p.b = normal.y();
+	p.c = normal.z();
+	p.d = -(p.a * a.x() + p.b * a.y() + p.c * a.z());
+	p.cross_y = maxY - minY;
+
+	p.color = qRgb(factor * 255, factor * 255, factor * 255);
+	p.shading = -1;
+
+	setup.polygons.push_back(p);
+
+	return true;
+}
+
+int SpanningScanline::ModelRender::addShadingMaterial(const MaterialInfo *material)
+{
+	ShadingMaterial m;
+
+	if (material) {
+		for (int c = 0; c < 3; c++) {
+			m.ambient[c] = material->Ambient[c] * 255.f;
+			m.diffuse[c] = material->Diffuse[c] * 255.f;
+			m.specular[c] = material->Specular[c] * 255.f;
+		}
+		m.shininess = material->Shininess;
+		m.texture = material->texture.data();
+	}
+	else {
+		// Looks like flat shading, only smooth
+		for (int c = 0; c < 3; c++) {
+			m.ambient[c] = 0.f;
+			m.diffuse[c] = 255.f;
+			m.specular[c] = 0.f;
+		}
+		m.shininess = 0.f;
+		m.texture = 0;
+	}
+
+	m_shadingMaterials.push_back(m);
+
+	return m_shadingMaterials.size() - 1;
+}
+
+void SpanningScanline::ModelRender::addShading(TriangleSetup &setup, Polygon &polygon, const QVector3D *vertices, const QVector3D *weights,
+	int vertexCount, const unsigned int *triangle, int material, bool textured)
+{
+	const ShadingMaterial &m = m_shadingMaterials[material];
+
+	// Fit the planes through the three vertices spanning the largest area,
+	// clipping can leave slivers at the others
+	int best = 1;
+	float bestArea = 0.f;
+	for (int i = 1; i + 1 < vertexCount; i++) {
+		const float area = (vertices[i].x() - vertices[0].x()) * (vertices[i + 1].y() - vertices[0].y()) -
+			(vertices[i + 1].x() - vertices[0].x()) * (vertices[i].y() - vertices[0].y());
+		if (std::abs(area) > std::abs(bestArea)) {
+			best = i;
+			bestArea = area;
+		}
+	}
+
+	const QVector3D *v[3] = { &vertices[0], &vertices[best], &vertices[best + 1] };
+	const QVector3D *w[3] = { &weights[0], &weights[best], &weights[best + 1] };
+
+	QVector3D corners[3];
+	for (int k = 0; k < 3; k++) {
+		corners[k] = getVertexFromBuffer(triangle[k]);
+	}
+
+	PolygonShading shading = PolygonShading();	// Planes a mode does not use stay 0
+	shading.material = material;
+	shading.texture = textured ? m.texture : 0;
+
+	QVector3D value[3];
+
+	if (m_shadingMode != ShadeFlat) {
+		QVector3D attributes[3];
+
+		for (int k = 0; k < 3; k++) {
+			const QVector3D normal = getNormalFromBuffer(triangle[k]).normalized();
+
+			if (m_shadingMode == ShadeGouraud) {
+				float rgb[3];
+				lightColor(QVector3D::dotProduct(normal, (m_camera_pos - corners[k]).normalized()), m, rgb);
+				attributes[k] = QVector3D(rgb[0], rgb[1], rgb[2]);
+			}
+			else {
+				attributes[k] = normal;
+			}
+		}
+
+		for (int k = 0; k < 3; k++) {
+			value[k] = interpolate(attributes, *w[k]);
+		}
+		fitShadingPlane(v, bestArea, value, shading.plane);
+
+		if (m_shadingMode == ShadePhong) {
+			const QVector3D view[3] = { m_camera_pos - corners[0], m_camera_pos - corners[1], m_camera_pos - corners[2] };
+
+			for (int k = 0; k < 3; k++) {
+				value[k] = interpolate(view, *w[k]);
+			}
+			fitShadingPlane(v, bestArea, value, shading.view);
+		}
+	}
+
+	if (shading.texture) {
+		// u, v and w are linear in clip space, where the weights come from,
+		// so they are interpolated first and divided after
+		QVector3D uvw[3];
+		for (int k = 0; k < 3; k++) {
+			const int index = triangle[k] * 2;
+			uvw[k] = QVector3D(m_textureUV[index], m_textureUV[index + 1], getClipVertex(triangle[k]).w());
+		}
+
+		for (int k = 0; k < 3; k++) {
+			const QVector3D p = interpolate(uvw, *w[k]);
+			value[k] = QVector3D(p.x() / p.z(), p.y() / p.z(), 1.f / p.z());
+		}
+		fitShadingPlane(v, bestArea, value, shading.textureCoordinates);
+	}
+
+	polygon.shading = setup.shading.size();
+	setup.shading.push_back(shading);
+}
+
+bool SpanningScanline::ModelRender::addSides(TriangleSetup &setup, const QVector3D *vertices, int vertexCount, int polygon_id, unsigned int first_side_id)
+{
+	// Side ids come from the triangle index, so they stay the same from frame
+	// to frame no matter which other triangles are culled.
+	for (int i = 0; i < vertexCount; i++) {
+		addSide(setup, vertices[i], vertices[(i + 1) % vertexCount], polygon_id, first_side_id + i);
+	}
+
+	return true;
+}
+
+bool SpanningScanline::ModelRender::addSide(TriangleSetup &setup, const QVector3D &a, const QVector3D &b, int polygon_id, unsigned int side_id)
+{
+	if (std::abs((int)a.y() - (int)b.y()) == 0) {  // ignore side parallel to scanline
+		return false;
+	}
+
+	QVector3D upper_vertex, lower_vertex;
+	if (a.y() > b.y()) {
+		upper_vertex = a;
+		lower_vertex = b;
+	}
+	else {
+		upper_vertex = b;
+		lower_vertex = a;
+	}
+
+	int max_y = upper_vertex.y(), min_y = lower_vertex.y();
+
+	if (max_y < 0 || min_y >= m_height - 1) {  // upper vertex out of screen bottom or lower vertex out of top
+		return false;
+	}
+
+	Side side;
+	side.cross_y = max_y - min_y;
+
+	// Anti-aliasing blends the pixels up to the next scanline's x, so that
+	// has to arrive at the lower vertex exactly
+	const float height = m_antiAliasing ? float(side.cross_y) : upper_vertex.y() - lower_vertex.y();
+	side.delta_x = -(upper_vertex.x() - lower_vertex.x()) / height;
+	side.polygon_id = polygon_id;
+	side.side_id = side_id;
+	side.x = upper_vertex.x();
+
+	// If the upper vertex out of screen top, we 'cut' this side at the top scanline
+	if (max_y >= m_height) {
+		const int skipped = max_y - (m_height - 1);
+
+		side.cross_y -= skipped;
+		side.x += skipped * side.delta_x;
+		max_y = m_height - 1;
+	}
+
+	setup.sides.push_back(side);
+	setup.sideRows.push_back(max_y);
+
+	return true;
+}
+
+void SpanningScanline::ModelRender::bucketSideTable()
+{
+	// Counting sort by starting scanline: count each row, prefix sum to
+	// the row starts, then scatter. Sides keep the order they were added in.
+	const int sideCount = m_pendingSides.size();
+	const Side *pending = m_pendingSides.constData();
+	const int *rows = m_pendingSideRows.constData();
+
+	int *rowStart = m_sideRowStart.data();
+	int *fill = m_sideRowFill.data();
+
+	std::fill(fill, fill + m_height, 0);
+	for (int i = 0; i < sideCount; i++) {
+		fill[rows[i]]++;
+	}
+
+	rowStart[0] = 0;
+	for (int y = 0; y < m_height; y++) {
+		rowStart[y + 1] = rowStart[y] + fill[y];
+		fill[y] = rowStart[y];
+	}
+
+	if (m_temporalCoherence) {
+		// Needs the last frame's side table, so before it is overwritten
+		orderPendingSidesByRank();
+	}
+
+	m_sideTable.resize(sideCount);
+	Side *sides = m_sideTable.data();
+
+	if (m_temporalCoherence) {
+		const int *order = m_sideOrder.constData();
+		for (int n = 0; n < sideCount; n++) {
+			const int i = order[n];
+			sides[fill[rows[i]]++] = pending[i];
+		}
+	}
+	else {
+		for (int i = 0; i < sideCount; i++) {
+			sides[fill[rows[i]]++] = pending[i];
+		}
+	}
+}
+
+void SpanningScanline::ModelRender::orderPendingSidesByRank()
 {
-	static bool isRendering = false;
-
-	if (isRendering) {
-		return false;
+	// Sides that were in the last frame go first, in last frame's order, so
+	// each row becomes a few runs already sorted by x unless the camera moved
+	// enough for sides to cross. New sides follow in the order they were
+	// added. The ranks are only a hint, any of them may be stale.
+	const int sideCount = m_pendingSides.size();
+	const int previousCount = m_sideTable.size();
+	const int idCount = (m_indices.size() + m_levelIndices.size()) / 3 * kMaxClippedVertices;
+	const Side *pending = m_pendingSides.constData();
+
+	if (m_sideRank.size() != idCount) {
+		m_sideRank.fill(-1, idCount);
 	}
+	int *rank = m_sideRank.data();
 
-	if (!initialPolygonTableAndSideTable()) {
-		return false;
-	}
+	m_rankSlots.fill(-1, previousCount);
+	int *slots = m_rankSlots.data();
 
-	isRendering = true;
+	for (int i = 0; i < sideCount; i++) {
+		const int r = rank[pending[i].side_id];
+		if (r >= 0 && r < previousCount && slots[r] == -1) {
+			slots[r] = i;
+		}
+	}
 
-	initialFrameBuffer();
+	m_sideOrder.resize(sideCount);
+	int *order = m_sideOrder.data();
+	int n = 0;
 
-	for (int curScanline = m_height - 1; curScanline >= 0; curScanline--) {
-		scanlineRender(curScanline);
+	for (int r = 0; r < previousCount; r++) {
+		if (slots[r] != -1) {
+			order[n++] = slots[r];
+		}
 	}
 
-	saveRenderResult();
+	for (int i = 0; i < sideCount; i++) {
+		const int r = rank[pending[i].side_id];
+		if (r < 0 || r >= previousCount || slots[r] != i) {
+			order[n++] = i;
+		}
+	}
 
-	isRendering = false;
+	// Forget the last frame, sortSideTableCoherent() ranks this one
+	const Side *previous = m_sideTable.constData();
+	for (int p = 0; p < previousCount; p++) {
+		if (previous[p].side_id < unsigned(idCount)) {
+			rank[previous[p].side_id] = -1;
+		}
+	}
+}
 
-	return true;
+int SpanningScanline::ModelRender::threadCount() const
+{
+#ifdef _OPENMP
+	return m_threadCount > 0 ? m_threadCount : omp_get_max_threads();
+#else
+	return 1;
+#endif
 }
 
-QImage SpanningScanline::ModelRender::getRenderResult()
+void SpanningScanline::ModelRender::initialBands()
 {
-	return m_result;
+	if (m_height <= 0) {
+		m_bands.clear();
+		m_bandHeight = 0;
+		return;
+	}
+
+	// Several bands per thread, so the dynamic schedule can balance bands
+	// of very different depth complexity.
+	const int threads = threadCount();
+	const int bandCount = min(threads == 1 ? 1 : threads * 4, m_height);
+
+	m_bandHeight = (m_height + bandCount - 1) / bandCount;
+	m_bands.resize((m_height + m_bandHeight - 1) / m_bandHeight);
+
+	for (int i = 0; i < m_bands.size(); i++) {
+		m_bands[i].top = m_height - 1 - i * m_bandHeight;
+		m_bands[i].bottom = max(0, m_bands[i].top - m_bandHeight + 1);
+	}
 }
 
-void SpanningScanline::ModelRender::setCameraPos(const QVector3D &pos)
+void SpanningScanline::ModelRender::seedBands()
 {
-	m_camera_pos = pos;
+	for (ScanlineBand &band : m_bands) {
+		band.seedSides.clear();
+	}
 
-	m_modelview = QMatrix4x4();
-	m_modelview.lookAt(pos, QVector3D(0.f, 0.f, 0.f), QVector3D(0.f, 1.f, 0.f));
+	if (m_bands.size() < 2) {
+		return;
+	}
+
+	// A side inserted at scanline y stays active down to y - cross_y + 1,
+	// so it has to be carried into every band whose top it crosses.
+	for (int y = m_height - 1; y > 0; y--) {
+		const int firstBand = (m_height - 1 - y) / m_bandHeight;
+
+		for (const Side *s_iter = sideRowBegin(y); s_iter != sideRowEnd(y); s_iter++) {
+			const Side &s = *s_iter;
+			const int lowest = y - s.cross_y + 1;
+
+			for (int b = firstBand + 1; b < m_bands.size() && m_bands[b].top >= lowest; b++) {
+				const int skipped = y - m_bands[b].top;
+
+				SeedSide seed;
+				seed.side = s;
+				seed.side.cross_y -= skipped;
+				seed.side.x += skipped * s.delta_x;
+				seed.firstX = s.x;
+				seed.steps = skipped;
+
+				m_bands[b].seedSides.push_back(seed);
+			}
+		}
+	}
 }
 
-void SpanningScanline::ModelRender::setWindowSize(int width, int height)
+template <bool collectStats>
+void SpanningScanline::ModelRender::renderBand(ScanlineBand &band)
 {
-	m_width = width;
-	m_height = height;
+#ifdef _OPENMP
+	const int thread = omp_get_thread_num();
+#else
+	const int thread = 0;
+#endif
+
+	// Borrowed from the thread for the band. Every scanline resets the slots
+	// it used, so they are all -1 again when the next band gets them.
+	band.polygonSlot.swap(m_threadPolygonSlots[thread]);
+	band.activePolygons.swap(m_threadActivePolygons[thread]);
+
+	// Grows with the polygon table, but is never shrunk or reallocated per scanline
+	if (band.polygonSlot.size() < m_polygonTable.size()) {
+		band.polygonSlot.fill(-1, m_polygonTable.size());
+		band.activePolygons.reserve(m_polygonTable.size());
+	}
 
-	m_sideTable = QVector<QVector<Side>>(height);
+	band.sideSwaps = 0;
+	band.peakActiveSides = 0;
+	band.spans = 0;
+	band.resolvedSpans = 0;
+	band.depthEvaluations = 0;
 
-	m_frame_buffer = QVector<QRgb>(width * height);
+	// Seeded sides arrive in side table order, only the band's first scanline
+	// pays for a full sort.
+	std::sort(band.seedSides.begin(), band.seedSides.end(), [](const SeedSide &a, const SeedSide &b) {
+		return a.side.x < b.side.x;
+	});
 
-	m_result = QImage(width, height, QImage::Format_RGB32);
+	ActiveSideList &activeSides = band.activeSides;
+	growActiveSides(activeSides, band.seedSides.size());
+	for (int i = 0; i < band.seedSides.size(); i++) {
+		const SeedSide &seed = band.seedSides[i];
+		setActiveSide(activeSides, i, seed.side, seed.firstX, seed.steps, m_fixedPointEdges);
+	}
+	activeSides.count = band.seedSides.size();
 
-	m_projection = QMatrix4x4();
-	m_projection.perspective(70.0, width / height, 0.1f, 100.f);
+	for (int curScanline = band.top; curScanline >= band.bottom; curScanline--) {
+		scanlineRender<collectStats>(band, curScanline);
+	}
 
-	m_viewport = QRect(0, 0, width, height);
+	band.polygonSlot.swap(m_threadPolygonSlots[thread]);
+	band.activePolygons.swap(m_threadActivePolygons[thread]);
 }
 
-bool SpanningScanline::ModelRender::initialPolygonTableAndSideTable()
+void SpanningScanline::ModelRender::sortSideTable()
 {
-	m_polygonTable.clear();
-	for (int i = 0; i < m_height; i++) {
-		m_sideTable[i].clear();
+	if (m_temporalCoherence) {
+		sortSideTableCoherent();
+		return;
 	}
 
-	m_activeSideList.clear();
+	// Sorting each row once here lets activateSides() merge new sides in
+	Side *sides = m_sideTable.data();
+	const int *rowStart = m_sideRowStart.constData();
 
-	int count = 0;
+	#pragma omp parallel for schedule(dynamic, 16)
+	for (int y = 0; y < m_height; y++) {
+		std::sort(sides + rowStart[y], sides + rowStart[y + 1], sideBefore);
+	}
+}
 
-	//#pragma omp parallel
-	{
-		QVector3D a, b, c, polygon_pos;
-		QVector3D a_normal, b_normal, c_normal, polygon_normal;
-		QVector3D a_project, b_project, c_project;
-		QVector3D view;
-		float factor = 0.f;
-
-		//#pragma omp for
-		for (int i = 0; i < m_indices.size(); i += 3) {
-			a = getVertexFromBuffer(m_indices[i]);
-			b = getVertexFromBuffer(m_indices[i + 1]);
-			c = getVertexFromBuffer(m_indices[i + 2]);
-
-			a_normal = getNormalFromBuffer(m_indices[i]);
-			b_normal = getNormalFromBuffer(m_indices[i + 1]);
-			c_normal = getNormalFromBuffer(m_indices[i + 2]);
+void SpanningScanline::ModelRender::sortSideTableCoherent()
+{
+	Side *sides = m_sideTable.data();
+	const int *rowStart = m_sideRowStart.constData();
 
-			// Get color factor by normal * view
-			polygon_pos = (a + b + c) / 3;
-			view = (m_camera_pos - polygon_pos).normalized();
-			polygon_normal = ((a_normal + b_normal + c_normal) / 3).normalized();
-			factor = QVector3D::dotProduct(polygon_normal, view);
+	int coherentRows = 0;
+	int fallbackRows = 0;
+	qint64 workSaved = 0;
 
-			//if (factor <= 0.f) {
-				//continue;
-			//}
+	#pragma omp parallel for schedule(dynamic, 16) reduction(+:coherentRows, fallbackRows, workSaved)
+	for (int y = 0; y < m_height; y++) {
+		Side *begin = sides + rowStart[y];
+		Side *end = sides + rowStart[y + 1];
+		const int n = int(end - begin);
+
+		if (n < 2) {
+			continue;
+		}
 
-			a_project = a.project(m_modelview, m_projection, m_viewport);
-			b_project = b.project(m_modelview, m_projection, m_viewport);
-			c_project = c.project(m_modelview, m_projection, m_viewport);
+		const int work = mergeSortedRuns(begin, end);
 
-			//#pragma omp critical
-			{
-				if (addPolygon(a_project, b_project, c_project, factor, count)) {
-					addSides(a_project, b_project, c_project, count);
+		if (work < 0) {
+			std::sort(begin, end, sideBefore);
 
-					count++;
-				}
-			}
+			fallbackRows++;
+			workSaved -= n - 1;
+		}
+		else {
+			coherentRows++;
+			workSaved += fullSortCost(n) - work;
 		}
+
+		Q_ASSERT(matchesFullSort(begin, end));
 	}
 
-	return true;
+	if (m_statsEnabled) {
+		m_stats.coherentSortRows = coherentRows;
+		m_stats.fallbackSortRows = fallbackRows;
+		m_stats.sortWorkSaved = workSaved;
+	}
+
+	// Rank the sides for the next frame
+	int *rank = m_sideRank.data();
+	const int sideCount = m_sideTable.size();
+
+	for (int p = 0; p < sideCount; p++) {
+		rank[sides[p].side_id] = p;
+	}
 }
 
-QVector3D SpanningScanline::ModelRender::getVertexFromBuffer(int index)
+void SpanningScanline::ModelRender::setTemporalCoherence(bool enabled)
 {
-	int true_index = index * 3;
-	QVector3D vertex(m_vertices[true_index], m_vertices[true_index + 1], m_vertices[true_index + 2]);
-	return vertex;
+	m_temporalCoherence = enabled;
+
+	if (!enabled) {
+		m_sideRank.clear();
+		m_rankSlots.clear();
+		m_sideOrder.clear();
+	}
 }
 
-QVector3D SpanningScanline::ModelRender::getNormalFromBuffer(int index)
+template <bool collectStats>
+void SpanningScanline::ModelRender::scanlineRender(ScanlineBand &band, int scanline)
 {
-	int true_index = index * 3;
-	QVector3D normal(m_normals[true_index], m_normals[true_index + 1], m_normals[true_index + 2]);
-	return normal;
+	activateSides(band, scanline);
+
+	if (collectStats) {
+		band.peakActiveSides = max(band.peakActiveSides, band.activeSides.count);
+	}
+
+	if (m_antiAliasing) {
+		scanAntiAliased<collectStats>(band, scanline);
+	}
+	else {
+		scan<collectStats>(band, scanline);
+	}
+	updateActiveSideList(band);
 }
 
-bool SpanningScanline::ModelRender::addPolygon(const QVector3D & a, const QVector3D & b, const QVector3D & c, float factor, int count)
+void SpanningScanline::ModelRender::beginFrame()
 {
-	int maxY = (int)std::max(std::max(a.y(), b.y()), c.y());
-	int minY = (int)std::min(std::min(a.y(), b.y()), c.y());
-
-	if (maxY < 0 || minY >= m_height) {  // totally out of screen
-		return false;
+	// Spans are drawn straight into the back image. Its memory is reused
+	// unless the last frame rendered into it is still held outside, e.g. by
+	// the display. Then a new image is allocated instead of detaching, which
+	// would copy a frame that is about to be overwritten anyway.
+	QImage &frame = m_frameImages[m_backImage];
+
+	if (frame.width() != m_width || frame.height() != m_height || !frame.isDetached()) {
+		frame = QImage(m_width, m_height, QImage::Format_RGB32);
 	}
 
-	/*
-	if (maxY >= m_height) {  // partly out of screen
-		// TO DO ...
-		// Actually it needs triangle clipping
-		return false;
+	m_frameBits = reinterpret_cast<QRgb *>(frame.bits());
+	m_frameStride = frame.bytesPerLine() / sizeof(QRgb);
+}
+
+void SpanningScanline::ModelRender::initialFrameBuffer()
+{
+	#pragma omp parallel for
+	for (int r = 0; r < m_height; r++) {
+		fillSpan(m_frameBits + r * m_frameStride, m_width, m_backgroundColor);
 	}
-	*/
+}
 
-	QVector3D normal = QVector3D::normal((a - b), (a - c));
-	if (normal.z() == 0) {
-		// printf("zero plane");
-		return false;
+bool SpanningScanline::ModelRender::activateSides(ScanlineBand &band, int scanline)
+{
+	// Sides stepped since the last scanline may have crossed each other
+	reorderActiveSideList(band);
+
+	const Side *newSides = sideRowBegin(scanline);
+	const int newCount = int(sideRowEnd(scanline) - newSides);
+	if (newCount == 0) {
+		return true;
 	}
 
-	// Add to polygon table
-	Polygon p;
-	p.id = count;
-	p.a = normal.x();
-	p.b = normal.y();
-	p.c = normal.z();
-	p.d = -(p.a * a.x() + p.b * a.y() + p.c * a.z());
-	p.cross_y = maxY - minY;
+	const bool fixedPoint = m_fixedPointEdges;
+	const ActiveSideList &active = band.activeSides;
+	ActiveSideList &merged = band.mergeBuffer;
+	growActiveSides(merged, active.count + newCount);
 
-	p.color = qRgb(factor * 255, factor * 255, factor * 255);
+	// Ties keep the active side first, like std::merge
+	int i = 0, j = 0, k = 0;
+	while (i < active.count && j < newCount) {
+		const float newX = fixedPoint ? toFixed(newSides[j].x) * kFixedToFloat : newSides[j].x;
+
+		if (newX < active.x[i]) {
+			setActiveSide(merged, k++, newSides[j], newSides[j].x, 0, fixedPoint);
+			j++;
+		}
+		else {
+			copyActiveSide(active, i++, merged, k++, fixedPoint);
+		}
+	}
+	while (i < active.count) {
+		copyActiveSide(active, i++, merged, k++, fixedPoint);
+	}
+	while (j < newCount) {
+		setActiveSide(merged, k++, newSides[j], newSides[j].x, 0, fixedPoint);
+		j++;
+	}
+	merged.count = k;
 
-	m_polygonTable.push_back(p);
+	std::swap(band.activeSides, band.mergeBuffer);
 
 	return true;
 }
 
-bool SpanningScanline::ModelRender::addSides(const QVector3D & a, const QVector3D & b, const QVector3D & c, int polygon_id)
+void SpanningScanline::ModelRender::reorderActiveSideList(ScanlineBand &band)
 {
-	addSide(a, b, polygon_id);
-	addSide(a, c, polygon_id);
-	addSide(b, c, polygon_id);
+	// Insertion passes, linear when no sides have crossed
+	ActiveSideList &sides = band.activeSides;
+	const bool fixedPoint = m_fixedPointEdges;
 
-	return true;
+	for (int i = 1; i < sides.count; i++) {
+		if (!(sides.x[i] < sides.x[i - 1])) {
+			continue;
+		}
+
+		const float x = sides.x[i];
+		const float deltaX = sides.deltaX[i];
+		const int fixedX = sides.fixedX[i];
+		const int fixedDeltaX = sides.fixedDeltaX[i];
+		const int crossY = sides.crossY[i];
+		const unsigned int polygonId = sides.polygonId[i];
+
+		int j = i;
+		while (j > 0 && x < sides.x[j - 1]) {
+			copyActiveSide(sides, j - 1, sides, j, fixedPoint);
+			j--;
+		}
+
+		sides.x[j] = x;
+		sides.deltaX[j] = deltaX;
+		sides.fixedX[j] = fixedX;
+		sides.fixedDeltaX[j] = fixedDeltaX;
+		sides.crossY[j] = crossY;
+		sides.polygonId[j] = polygonId;
+
+		band.sideSwaps += i - j;
+	}
 }
 
-bool SpanningScanline::ModelRender::addSide(const QVector3D &a, const QVector3D &b, int polygon_id)
+template <bool collectStats>
+void SpanningScanline::ModelRender::scan(ScanlineBand &band, int line)
 {
-	if (std::abs((int)a.y() - (int)b.y()) == 0) {  // ignore side parallel to scanline
-		return false;
-	}
+	const ActiveSideList &sides = band.activeSides;
+	const float *sideX = sides.x.constData();
+	const unsigned int *sidePolygon = sides.polygonId.constData();
+	QVector<int> &activePolygons = band.activePolygons;
+	int leftSide = 0;
 
-	QVector3D upper_vertex, lower_vertex;
-	if (a.y() > b.y()) {
-		upper_vertex = a;
-		lower_vertex = b;
-	}
-	else {
-		upper_vertex = b;
-		lower_vertex = a;
-	}
+	// Spans run from side to side, so only the first one can leave a gap
+	// before it. Up to here the row has been drawn.
+	int drawnUntil = 0;
 
-	int max_y = upper_vertex.y(), min_y = lower_vertex.y();
-	float x_of_max_y = upper_vertex.x(), x_of_min_y = lower_vertex.x();
+	while (leftSide < sides.count && sideX[leftSide] < m_width) {
+		const float leftX = sideX[leftSide];
 
-	if (max_y < 0 || min_y >= m_height - 1) {  // upper vertex out of screen bottom or lower vertex out of top
-		return false;
-	}
+		// Update activePolygons
+		togglePolygon(band, sidePolygon[leftSide]);
 
-	Side side;
-	side.cross_y = max_y - min_y;
-	side.delta_x = -(upper_vertex.x() - lower_vertex.x()) / (upper_vertex.y() - lower_vertex.y());
-	side.polygon_id = polygon_id;
-	side.x = upper_vertex.x();
+		const int rightSide = leftSide + 1;
+
+		if (rightSide < sides.count) {
+			const float rightX = sideX[rightSide];
+			QRgb color = activePolygons.empty() ? m_backgroundColor : qRgb(255, 255, 255);
+			int shading = -1;
+
+			const int closestPolygonId = visiblePolygon<collectStats>(band, (leftX + rightX) / 2.f, line);
+			if (closestPolygonId != -1) {
+				color = m_polygonTable[closestPolygonId].color;
+				shading = m_polygonTable[closestPolygonId].shading;
+			}
+
+			const int spanLeft = int(leftX);
+			const int spanRight = int(rightX);
+
+			if (m_coverageComplete && spanLeft > drawnUntil) {
+				drawLine(drawnUntil, spanLeft, line, m_backgroundColor);
+			}
 
-	// If the upper vertex out of screen top, we 'cut' this side
-	while (max_y >= m_height) {
-		side.cross_y--;
-		side.x += side.delta_x;
-		max_y--;
+			if (shading != -1) {
+				shadeLine(spanLeft, spanRight, line, color, m_polygonShading[shading]);
+			}
+			else {
+				drawLine(spanLeft, spanRight, line, color);
+			}
+			drawnUntil = max(drawnUntil, spanRight);
+		}
+
+		leftSide = rightSide;
 	}
 
-	m_sideTable[max_y].push_back(side);
+	if (m_coverageComplete) {
+		drawLine(drawnUntil, m_width, line, m_backgroundColor);
+	}
 
-	return true;
+	// Sides right of the screen were never reached, so reset what is left
+	for (int id : activePolygons) {
+		band.polygonSlot[id] = -1;
+	}
+	activePolygons.clear();
 }
 
-void SpanningScanline::ModelRender::scanlineRender(int scanline)
+template <bool collectStats>
+void SpanningScanline::ModelRender::scanAntiAliased(ScanlineBand &band, int line)
 {
-	int a = 1;
-	if (scanline == m_height - 1) {
-		a = 0;
+	const ActiveSideList &sides = band.activeSides;
+	const float *sideX = sides.x.constData();
+	const float *sideDeltaX = sides.deltaX.constData();
+	const unsigned int *sidePolygon = sides.polygonId.constData();
+	QVector<int> &activePolygons = band.activePolygons;
+
+	if (band.edgeCoverage.size() != m_width * 4) {
+		band.edgeCoverage.fill(0.f, m_width * 4);
+		band.edgeShades.resize(m_width);
+		band.edgePixels.reserve(m_width);
 	}
 
-	activateSides(scanline);
-	scan(scanline);
-	updateActiveSideList();
-}
+	// Every span runs from side to side, the row's ends count as vertical sides
+	const float width = float(m_width);
+	EdgeRamp left = { 0.f, 0.f, 0.f };
+	int side = 0;
+
+	for (;;) {
+		const bool lastSpan = side == sides.count || sideX[side] >= width;
+		EdgeRamp right = { width, width, width };
+
+		// A side runs straight from here to its x on the next scanline, where
+		// its lower vertex is on its last one
+		if (!lastSpan) {
+			const float x = sideX[side];
+			const float nextX = x + sideDeltaX[side];
+			right.x = x;
+			right.lo = min(x, nextX);
+			right.hi = max(x, nextX);
+		}
 
-void SpanningScanline::ModelRender::initialFrameBuffer()
-{
-	#pragma omp parallel for
-	for (int i = 0; i < m_height * m_width; i++) {
-		m_frame_buffer[i] = m_backgroundColor;
+		QRgb color = activePolygons.empty() ? m_backgroundColor : qRgb(255, 255, 255);
+		int shading = -1;
+
+		const int closestPolygonId = visiblePolygon<collectStats>(band, (left.x + right.x) / 2.f, line);
+		if (closestPolygonId != -1) {
+			color = m_polygonTable[closestPolygonId].color;
+			shading = m_polygonTable[closestPolygonId].shading;
+		}
+
+		coverSpan(band, left, right, line, color, shading);
+
+		if (lastSpan) {
+			break;
+		}
+
+		togglePolygon(band, sidePolygon[side]);
+		left = right;
+		side++;
+	}
+
+	resolveEdgePixels(band, line);
+
+	for (int id : activePolygons) {
+		band.polygonSlot[id] = -1;
 	}
+	activePolygons.clear();
 }
 
-bool SpanningScanline::ModelRender::activateSides(int scanline)
+// The closest active polygon in the middle of a span, -1 if there is none
+template <bool collectStats>
+int SpanningScanline::ModelRender::visiblePolygon(ScanlineBand &band, float x, int line)
 {
-	for (const Side &s : m_sideTable[scanline]) {
-		m_activeSideList.push_back(s);
+	const QVector<int> &activePolygons = band.activePolygons;
+
+	if (activePolygons.empty()) {
+		return -1;
 	}
 
-	qSort(m_activeSideList.begin(), m_activeSideList.end(), [](const Side &a, const Side &b) {
-		return a.x < b.x;
-	});
+	if (collectStats) {
+		band.spans++;
+		if (activePolygons.size() > 1) {
+			band.resolvedSpans++;
+			band.depthEvaluations += activePolygons.size();
+		}
+	}
 
-	return true;
+	if (activePolygons.size() == 1) {
+		return activePolygons.first();
+	}
+
+	float min_z = m_max_z;
+	int closestPolygonId = -1;
+
+	for (int id : activePolygons) {
+		const Polygon &p = m_polygonTable[id];
+		float z = -(p.a * x + p.b * line + p.d) / p.c;
+		if (z < min_z || (z == min_z && id < closestPolygonId)) {
+			min_z = z;
+			closestPolygonId = id;
+		}
+	}
+
+	return closestPolygonId;
 }
 
-void SpanningScanline::ModelRender::scan(int line)
+void SpanningScanline::ModelRender::coverSpan(ScanlineBand &band, const EdgeRamp &left, const EdgeRamp &right,
+	int y, QRgb color, int shading)
 {
-	auto s_iter_left = m_activeSideList.begin();
+	// Between the two sides of an edge shared by neighbouring polygons
+	if (left.lo == right.lo && left.hi == right.hi) {
+		return;
+	}
 
-	QMap<int, Polygon> activePolygonMap;
-	while (s_iter_left != m_activeSideList.end() && s_iter_left->x < m_width) {
-		Side &s_left = *s_iter_left;
+	const float width = float(m_width);
 
-		// Update activePolygonList
-		auto p_iter = activePolygonMap.find(s_left.polygon_id);
-		if (p_iter == activePolygonMap.end()) {
-			activePolygonMap[s_left.polygon_id] = m_polygonTable[s_left.polygon_id];
+	// Pixels clear of both ramps belong to this span alone
+	const int interiorBegin = int(std::ceil(qBound(0.f, left.hi, width)));
+	const int interiorEnd = int(std::floor(qBound(0.f, right.lo, width)));
+	const int first = int(std::floor(qBound(0.f, min(left.lo, right.lo), width)));
+	const int last = int(std::ceil(qBound(0.f, max(left.hi, right.hi), width)));
+
+	if (interiorBegin < interiorEnd) {
+		if (shading != -1) {
+			shadeLine(interiorBegin, interiorEnd, y, color, m_polygonShading[shading]);
 		}
 		else {
-			activePolygonMap.erase(p_iter);
+			drawLine(interiorBegin, interiorEnd, y, color);
 		}
 
-		auto s_iter_right = s_iter_left + 1;
+		addEdgeCoverage(band, left, right, first, interiorBegin, y, color, shading);
+		addEdgeCoverage(band, left, right, interiorEnd, last, y, color, shading);
+	}
+	else {
+		// The ramps meet or cross, every pixel of the span is shared
+		addEdgeCoverage(band, left, right, first, last, y, color, shading);
+	}
+}
+
+void SpanningScanline::ModelRender::addEdgeCoverage(ScanlineBand &band, const EdgeRamp &left, const EdgeRamp &right,
+	int begin, int end, int y, QRgb color, int shading)
+{
+	if (begin >= end) {
+		return;
+	}
 
-		if (s_iter_right != m_activeSideList.end()) {
-			Side &s_right = *s_iter_right;
-			QRgb color = qRgb(255, 255, 255);
+	QRgb *shades = band.edgeShades.data();
+	if (shading != -1) {
+		shadePixels(shades, begin, end, y, color, m_polygonShading[shading]);
+	}
+	else {
+		std::fill(shades, shades + (end - begin), color);
+	}
 
-			if (activePolygonMap.size() > 1) {  // find closest polygon
-				float x = (s_left.x + s_right.x) / 2.f;
-				float min_z = m_max_z;
-				int closestPolygonId = -1;
+	// Signed: where sides cross within the scanline a span covers less than
+	// nothing, and the coverage of all spans still adds up to one
+	float *coverage = band.edgeCoverage.data();
 
-				for (auto &p : activePolygonMap) {
-					float z = -(p.a * x + p.b * line + p.d) / p.c;
-					if (z < min_z) {
-						min_z = z;
-						closestPolygonId = p.id;
-					}
-				}
+	for (int x = begin; x < end; x++) {
+		const float area = areaRightOf(left, x) - areaRightOf(right, x);
+		float *pixel = coverage + x * 4;
 
-				if (closestPolygonId != -1) {
-					color = m_polygonTable[closestPolygonId].color;
-				}
-			} else if (!activePolygonMap.empty()) {
-				color = activePolygonMap.begin()->color;
-			}
-			else {
-				color = m_backgroundColor;
-			}
+		const QRgb shade = shades[x - begin];
+		pixel[0] += qRed(shade) * area;
+		pixel[1] += qGreen(shade) * area;
+		pixel[2] += qBlue(shade) * area;
+		pixel[3] += area;
+	}
 
-			drawLine(s_left.x, s_right.x, line, color);
-		}
+	band.edgePixels.push_back(begin);
+	band.edgePixels.push_back(end);
+}
 
-		s_iter_left = s_iter_right;
+void SpanningScanline::ModelRender::resolveEdgePixels(ScanlineBand &band, int y)
+{
+	QRgb *pixels = m_frameBits + (m_height - 1 - y) * m_frameStride;
+	float *coverage = band.edgeCoverage.data();
+
+	// Whatever coverage a pixel lacks belongs to the span that filled it as
+	// its interior. A pixel in two runs is resolved once, then left as it is.
+	for (int i = 0; i < band.edgePixels.size(); i += 2) {
+		for (int x = band.edgePixels[i]; x < band.edgePixels[i + 1]; x++) {
+			float *pixel = coverage + x * 4;
+			const QRgb filled = pixels[x];
+			const float rest = 1.f - pixel[3];
+			const float rgb[3] = { pixel[0] + qRed(filled) * rest, pixel[1] + qGreen(filled) * rest,
+				pixel[2] + qBlue(filled) * rest };
+
+			pixels[x] = packColor(rgb);
+
+			pixel[0] = pixel[1] = pixel[2] = pixel[3] = 0.f;
+		}
 	}
+
+	band.edgePixels.clear();
 }
 
-void SpanningScanline::ModelRender::updateActiveSideList()
+void SpanningScanline::ModelRender::togglePolygon(ScanlineBand &band, int polygon_id)
 {
-	auto s_iter = m_activeSideList.begin();
+	QVector<int> &activePolygons = band.activePolygons;
+	int &slot = band.polygonSlot[polygon_id];
 
-	while (s_iter != m_activeSideList.end()) {
-		Side &s = *s_iter;
+	if (slot == -1) {
+		slot = activePolygons.size();
+		activePolygons.push_back(polygon_id);
+	}
+	else {
+		// Swap the last active polygon into the freed slot
+		const int last = activePolygons.last();
+		activePolygons[slot] = last;
+		band.polygonSlot[last] = slot;
+		activePolygons.removeLast();
+		slot = -1;
+	}
+}
 
-		s.cross_y--;
-		if (s.cross_y <= 0) {
-			s_iter = m_activeSideList.erase(s_iter);
-			continue;
+void SpanningScanline::ModelRender::updateActiveSideList(ScanlineBand &band)
+{
+	ActiveSideList &sides = band.activeSides;
+	const int count = sides.count;
+
+	float *x = sides.x.data();
+	float *deltaX = sides.deltaX.data();
+	int *fixedX = sides.fixedX.data();
+	int *fixedDeltaX = sides.fixedDeltaX.data();
+	int *crossY = sides.crossY.data();
+	unsigned int *polygonId = sides.polygonId.data();
+
+	// Step every side, finished ones too. No branches, so these vectorize.
+	int finished = 0;
+	if (m_fixedPointEdges) {
+		for (int i = 0; i < count; i++) {
+			fixedX[i] += fixedDeltaX[i];
+			x[i] = fixedX[i] * kFixedToFloat;
+			crossY[i]--;
+			finished += crossY[i] <= 0;
+		}
+	}
+	else {
+		for (int i = 0; i < count; i++) {
+			x[i] += deltaX[i];
+			crossY[i]--;
+			finished += crossY[i] <= 0;
 		}
+	}
+
+	if (finished == 0) {
+		return;
+	}
 
-		s.x += s.delta_x;
+	// Compact in one pass: every side is written to the next free slot,
+	// which only moves on past sides that are still active.
+	int kept = 0;
+	for (int i = 0; i < count; i++) {
+		const int cross = crossY[i];
 
-		s_iter++;
+		x[kept] = x[i];
+		deltaX[kept] = deltaX[i];
+		fixedX[kept] = fixedX[i];
+		fixedDeltaX[kept] = fixedDeltaX[i];
+		crossY[kept] = cross;
+		polygonId[kept] = polygonId[i];
+
+		kept += cross > 0;
 	}
+
+	sides.count = kept;
 }
 
 int SpanningScanline::ModelRender::findClosestPolygon(int x, int y)
@@ -345,30 +2018,148 @@ int SpanningScanline::ModelRender::findClosestPolygon(int x, int y)
 
 void SpanningScanline::ModelRender::drawLine(int x1, int x2, int y, QRgb color)
 {
-	int offset = (m_height - 1 - y) * m_width;
+	const int begin = max(0, x1);
+	const int end = min(x2, m_width);
 
-	for (int x = max(0, x1); x < min(x2, m_width); x++) {
-		m_frame_buffer[offset + x] = color;
+	if (begin < end) {
+		fillSpan(m_frameBits + (m_height - 1 - y) * m_frameStride + begin, end - begin, color);
 	}
 }
 
-void SpanningScanline::ModelRender::saveRenderResult()
+void SpanningScanline::ModelRender::shadeLine(int x1, int x2, int y, QRgb color, const PolygonShading &shading)
 {
-	/*
-	#pragma omp parallel for
-	for (int r = 0; r < m_height; r++) {
-		for (int c = 0; c < m_width; c++) {
-			m_result.setPixel(c, m_height - 1 - r, m_frame_buffer[r][c]);
+	const int begin = max(0, x1);
+	const int end = min(x2, m_width);
+
+	if (begin < end) {
+		shadePixels(m_frameBits + (m_height - 1 - y) * m_frameStride + begin, begin, end, y, color, shading);
+	}
+}
+
+// pixels holds the span from x = begin on
+void SpanningScanline::ModelRender::shadePixels(QRgb *pixels, int begin, int end, int y, QRgb color,
+	const PolygonShading &shading)
+{
+	const ShadingPlane &plane = shading.plane;
+
+	// Evaluated once at the first pixel's center, then only stepped
+	float value[3];
+	for (int c = 0; c < 3; c++) {
+		value[c] = plane.origin[c] + plane.dx[c] * (begin + 0.5f) + plane.dy[c] * y;
+	}
+
+	if (m_shadingMode == ShadeFlat) {
+		fillSpan(pixels, end - begin, color);
+	}
+	else if (m_shadingMode == ShadeGouraud) {
+		for (int x = begin; x < end; x++) {
+			pixels[x - begin] = packColor(value);
+
+			for (int c = 0; c < 3; c++) {
+				value[c] += plane.dx[c];
+			}
 		}
 	}
-	*/
+	else {
+		const ShadingMaterial &material = m_shadingMaterials[shading.material];
+		const ShadingPlane &viewPlane = shading.view;
+		float view[3], rgb[3];
 
-	QRgb *st = (QRgb*)m_result.bits();
-	const int pixelCount = m_result.width() * m_result.height();
+		for (int c = 0; c < 3; c++) {
+			view[c] = viewPlane.origin[c] + viewPlane.dx[c] * (begin + 0.5f) + viewPlane.dy[c] * y;
+		}
 
-	#pragma omp parallel for
-	for (int p = 0; p < pixelCount; p++) {
-		// st[p] has an individual pixel
-		st[p] = m_frame_buffer[p];
+		for (int x = begin; x < end; x++) {
+			// Both vectors are interpolated unnormalized, one square root
+			// normalizes the pair
+			const float lengths = (value[0] * value[0] + value[1] * value[1] + value[2] * value[2]) *
+				(view[0] * view[0] + view[1] * view[1] + view[2] * view[2]);
+			const float cosine = lengths > 0.f ? (value[0] * view[0] + value[1] * view[1] + value[2] * view[2]) / std::sqrt(lengths) : 0.f;
+
+			lightColor(cosine, material, rgb);
+			pixels[x - begin] = packColor(rgb);
+
+			for (int c = 0; c < 3; c++) {
+				value[c] += plane.dx[c];
+				view[c] += viewPlane.dx[c];
+			}
+		}
+	}
+
+	if (shading.texture) {
+		textureLine(pixels, begin, end, y, shading);
+	}
+}
+
+void SpanningScanline::ModelRender::textureLine(QRgb *pixels, int begin, int end, int y, const PolygonShading &shading)
+{
+	const Texture &texture = *shading.texture;
+	const ShadingPlane &plane = shading.textureCoordinates;
+
+	// Mip level from how far u and v move per pixel, along x and along y, in
+	// the middle of the span
+	const float middle = (begin + end) * 0.5f;
+	const float q = plane.origin[2] + plane.dx[2] * middle + plane.dy[2] * y;
+	const float u = (plane.origin[0] + plane.dx[0] * middle + plane.dy[0] * y) / q;
+	const float v = (plane.origin[1] + plane.dx[1] * middle + plane.dy[1] * y) / q;
+
+	const float dudx = (plane.dx[0] - u * plane.dx[2]) / q * texture.width(0);
+	const float dvdx = (plane.dx[1] - v * plane.dx[2]) / q * texture.height(0);
+	const float dudy = (plane.dy[0] - u * plane.dy[2]) / q * texture.width(0);
+	const float dvdy = (plane.dy[1] - v * plane.dy[2]) / q * texture.height(0);
+	const float footprint = max(dudx * dudx + dvdx * dvdx, dudy * dudy + dvdy * dvdy);
+
+	int level = 0;
+	if (footprint > 1.f) {
+		level = min(int(0.5f * std::log2(footprint)), texture.levelCount() - 1);
 	}
-}
\ No newline at end of file
+
+	// Texel coordinates in 16.16 fixed point
+	const double width = texture.width(level) * double(kFixedOne);
+	const double height = texture.height(level) * double(kFixedOne);
+
+	float x = begin + 0.5f;
+	float q0 = plane.origin[2] + plane.dx[2] * x + plane.dy[2] * y;
+	float u0 = (plane.origin[0] + plane.dx[0] * x + plane.dy[0] * y) / q0;
+	float v0 = (plane.origin[1] + plane.dx[1] * x + plane.dy[1] * y) / q0;
+
+	for (int segment = begin; segment < end; segment += kTextureStep) {
+		const int count = min(kTextureStep, end - segment);
+
+		x += count;
+		const float q1 = plane.origin[2] + plane.dx[2] * x + plane.dy[2] * y;
+		const float u1 = (plane.origin[0] + plane.dx[0] * x + plane.dy[0] * y) / q1;
+		const float v1 = (plane.origin[1] + plane.dx[1] * x + plane.dy[1] * y) / q1;
+
+		// Starting within the first repeat keeps the fixed point values small
+		const float uRepeat = std::floor(u0), vRepeat = std::floor(v0);
+		qint64 s = qint64((u0 - uRepeat) * width);
+		qint64 t = qint64((v0 - vRepeat) * height);
+		const qint64 ds = qint64((u1 - u0) * width / count);
+		const qint64 dt = qint64((v1 - v0) * height / count);
+
+		QRgb *p = pixels + (segment - begin);
+		for (int i = 0; i < count; i++) {
+			const QRgb texel = texture.texel(level, int(s >> 16), int(t >> 16));
+			const QRgb shaded = p[i];
+
+			p[i] = qRgb((qRed(shaded) * (qRed(texel) + 1)) >> 8,
+				(qGreen(shaded) * (qGreen(texel) + 1)) >> 8,
+				(qBlue(shaded) * (qBlue(texel) + 1)) >> 8);
+
+			s += ds;
+			t += dt;
+		}
+
+		u0 = u1;
+		v0 = v1;
+	}
+}
+
+void SpanningScanline::ModelRender::presentFrame()
+{
+	// Shares the finished image, the next frame goes into the other one
+	m_result = m_frameImages[m_backImage];
+	m_backImage = 1 - m_backImage;
+	m_frameBits = 0;
+}
@@ -3,12 +3,20 @@
 #include <QVector>
 #include <QMatrix4x4>
 #include <QImage>
+#include <QSharedPointer>
+#include <QSet>
+#include <QElapsedTimer>
 
 #include <iostream>
 
 using namespace std;
 
 namespace SpanningScanline {
+	struct Node;
+	struct Mesh;
+	struct MaterialInfo;
+	class Texture;
+
 	struct Polygon {
 		unsigned int id;
 
@@ -17,6 +25,37 @@ namespace SpanningScanline {
 		int cross_y;	// The number of scanlines crossed by the polygon
 		
 		QRgb color;
+		int shading;	// Index into the shading table, -1 when drawn in color
+	};
+
+	// One attribute with three channels, linear over a polygon in window
+	// coordinates: value(x, y) = origin + dx * x + dy * y
+	struct ShadingPlane {
+		float origin[3];
+		float dx[3];
+		float dy[3];
+	};
+
+	// Material colors scaled to 0..255, lit by a light at the camera
+	struct ShadingMaterial {
+		float ambient[3];
+		float diffuse[3];
+		float specular[3];
+		float shininess;	// No highlight when 0
+		const Texture *texture;	// Multiplied with the shaded color, or null
+	};
+
+	// Set up once per polygon, so spans are shaded with one add per channel
+	// and pixel. Gouraud interpolates the lit color, Phong the normal.
+	struct PolygonShading {
+		ShadingPlane plane;
+		ShadingPlane view;	// Phong only, from the surface to the camera
+		int material;		// Index into the material table
+
+		// u / w, v / w and 1 / w, which unlike u and v are linear in window
+		// coordinates. Only set up when texture isn't null.
+		ShadingPlane textureCoordinates;
+		const Texture *texture;
 	};
 
 	struct Side {
@@ -24,6 +63,7 @@ namespace SpanningScanline {
 		float delta_x;		// dy / dx = k, delta_x = -1 / k
 		int cross_y;		// The number of scanlines crossed by the side
 		float x;				// the x value of point y_max
+		unsigned int side_id;	// Same for the same edge in every frame of a scene
 
 		void print() {
 			cout << "polygon_id :" << polygon_id << endl;
@@ -33,55 +73,342 @@ namespace SpanningScanline {
 		}
 	};
 
+	// Counters of the last render() call. The cull counters are always
+	// collected, everything else only with setStatsEnabled(true).
+	struct RenderStats {
+		int culledBackFace;		// Polygons facing away from the camera
+		int culledNearFar;		// Polygons in front of the near or behind the far plane
+		int culledLeftRight;	// Polygons left or right of the view frustum
+		int culledNodes;		// Node subtrees whose bounds are outside the view frustum
+		int culledMeshes;		// Meshes whose bounds are outside the view frustum
+		int simplifiedMeshes;	// Meshes drawn at one of their levels of detail
+
+		qint64 activeSideSwaps;	// Swaps needed to keep the active side lists ordered by x
+
+		int submittedPolygons;	// Triangles of the meshes that survived hierarchical culling
+		int rejectedPolygons;	// Clipped away, off-screen or degenerate, after culling
+		int insertedPolygons;	// Entries of the polygon table
+		qint64 sides;			// Entries of the side table
+		int peakActiveSides;	// Longest active side list of any scanline
+
+		qint64 spans;				// Spans covered by at least one polygon
+		qint64 resolvedSpans;		// Spans covered by several polygons, needing depth resolution
+		qint64 depthEvaluations;	// Plane equations evaluated to resolve them
+
+		// With temporal coherence
+		int coherentSortRows;		// Side table rows sorted starting from the last frame's order
+		int fallbackSortRows;		// Rows too far from that order, sorted from scratch
+		qint64 sortWorkSaved;		// Estimated comparisons saved against sorting every row from scratch
+
+		// Wall time of each stage, in milliseconds
+		double setupTime;		// Transforming, culling and clipping, filling the polygon and side tables
+		double sideTableTime;	// Sorting the side table and seeding the bands
+		double scanTime;		// Clearing the framebuffer and scanning every band
+	};
+
+	// Active sides as parallel arrays, ordered by x. Only the first count
+	// entries are in use, the arrays never shrink. fixedX and fixedDeltaX
+	// are x and delta_x in 16.16 fixed point, kept only when edges are
+	// stepped in fixed point. x is then derived from fixedX.
+	struct ActiveSideList {
+		QVector<float> x;
+		QVector<float> deltaX;
+		QVector<int> fixedX;
+		QVector<int> fixedDeltaX;
+		QVector<int> crossY;
+		QVector<unsigned int> polygonId;
+		int count;
+
+		ActiveSideList() : count(0) {}
+	};
+
+	// A side that starts above a band, stepped down to the band's top
+	struct SeedSide {
+		Side side;		// x and cross_y already stepped
+		float firstX;	// x on the side's first scanline
+		int steps;		// Scanlines stepped
+	};
+
+	// A horizontal slice of the screen, scanned independently of the others.
+	// Sides starting above the band are seeded into seedSides.
+	struct ScanlineBand {
+		int top;		// The highest scanline of the band
+		int bottom;		// The lowest scanline of the band
+
+		QVector<SeedSide> seedSides;
+		ActiveSideList activeSides;
+		ActiveSideList mergeBuffer;
+		qint64 sideSwaps;
+
+		// Only counted when the render statistics are enabled
+		int peakActiveSides;
+		qint64 spans;
+		qint64 resolvedSpans;
+		qint64 depthEvaluations;
+
+		// Polygons the current scanline is inside of. polygonSlot is indexed by
+		// polygon id and holds the position in activePolygons, or -1. Both
+		// belong to the thread scanning the band and are only lent to it.
+		QVector<int> polygonSlot;
+		QVector<int> activePolygons;
+
+		// Anti-aliasing only: red, green, blue times coverage and the coverage
+		// of each pixel of the current scanline, and which pixels have any
+		QVector<float> edgeCoverage;
+		QVector<int> edgePixels;
+		QVector<QRgb> edgeShades;
+	};
+
+	// What a chunk of consecutive triangles adds to the polygon, shading and
+	// side tables. Polygon ids and shading indices count from the chunk's
+	// start until the chunks are joined at the bases.
+	struct TriangleSetup {
+		QVector<Polygon> polygons;
+		QVector<PolygonShading> shading;
+		QVector<Side> sides;
+		QVector<int> sideRows;	// The scanline each side starts on
+
+		int culledBackFace;
+		int culledNearFar;
+		int culledLeftRight;
+
+		int polygonBase;
+		int shadingBase;
+		int sideBase;
+	};
+
+	// The pixels a side passes through on one scanline: x on the scanline,
+	// and lo to hi from there down to the next scanline
+	struct EdgeRamp {
+		float x;
+		float lo;
+		float hi;
+	};
+
 	class ModelRender
 	{
 	public:
+		enum CullMode {
+			CullNone = 0x0,
+			CullBackFace = 0x1,
+			CullNearFar = 0x2,
+			CullLeftRight = 0x4,
+			CullHierarchy = 0x8,
+			CullAll = CullBackFace | CullNearFar | CullLeftRight | CullHierarchy
+		};
+
+		enum ShadingMode {
+			ShadeFlat,		// One grey per polygon from its averaged normal
+			ShadeGouraud,	// Lit at the vertices with the mesh's material, color interpolated
+			ShadePhong		// Normal interpolated and lit at every pixel
+		};
+
 		ModelRender(QRgb backgroundColor);
 		void setBufferData(const QVector<float> &vertices, const QVector<float> &normals, const QVector<unsigned int> &indices);
+		// Triangles of the meshes' levels of detail, see Mesh::levels. Empty
+		// by default, then every mesh is drawn at full resolution.
+		void setLevelIndices(const QVector<unsigned int> &indices) { m_levelIndices = indices; }
+		// Calls on one renderer must not overlap, separate renderers are
+		// independent. RenderWorker only calls it from its own thread.
 		bool render();
+		// Shares the image spans were drawn into, nothing is copied. Holding on
+		// to it is fine, the renderer then allocates a new one for the frame
+		// after next instead of overwriting it.
 		QImage getRenderResult();
+		const RenderStats &getRenderStats() const { return m_stats; }
 
 		void setCameraPos(const QVector3D &pos);
+		// Lets whole node subtrees and meshes be culled by their bounds. Without
+		// node data every triangle of the index buffer is set up.
+		void setNodeData(const QSharedPointer<Node> &rootNode) { m_rootNode = rootNode; }
+
 		void setModelviewMatrix(const QMatrix4x4 &m) { m_modelview = m; }
 		void setWindowSize(int width, int height);
 
+		// 0 uses every available core, 1 renders the whole screen as a single band.
+		void setThreadCount(int count);
+
+		// Combination of CullMode flags, CullAll by default.
+		void setCullMode(int mode) { m_cullMode = mode; }
+
+		// Off by default. When off, the scan loop is compiled without any
+		// counting and the stats hold only the cull counters.
+		void setStatsEnabled(bool enabled) { m_statsEnabled = enabled; }
+
+		// On by default: scan() draws the background left and right of the
+		// outermost sides too, so every pixel is written exactly once and the
+		// separate background clear is skipped.
+		void setCoverageComplete(bool enabled) { m_coverageComplete = enabled; }
+
+		// Off by default. Steps side x in 16.16 fixed point instead of float,
+		// so tall sides do not drift and every platform gets the same pixels.
+		void setFixedPointEdges(bool enabled) { m_fixedPointEdges = enabled; }
+
+		// Off by default. Remembers the order sides ended up in and starts the
+		// next frame's side table sort from it, so a small camera move leaves
+		// little sorting to do. Rows that changed a lot are sorted from scratch.
+		void setTemporalCoherence(bool enabled);
+
+		// ShadeFlat by default. The smooth modes use the vertex normals and
+		// the materials of the node data, or a white diffuse material without it.
+		void setShadingMode(ShadingMode mode) { m_shadingMode = mode; }
+
+		// Two per vertex, like channel 0 of ModelLoader::getTextureData().
+		// Meshes whose material has a texture are then drawn textured in every
+		// shading mode. Empty by default.
+		void setTextureCoordinates(const QVector<float> &textureUV) { m_textureUV = textureUV; }
+
+		// Off by default. Pixels a side passes through are blended from the
+		// spans on either side, weighted by the exact area each one covers.
+		// Span interiors are still filled plainly, and scan() always draws the
+		// background itself.
+		void setAntiAliasing(bool enabled) { m_antiAliasing = enabled; }
+
+		// 1 by default. Meshes of the node data are drawn at the coarsest level
+		// of detail whose error is at most this many pixels on screen, judged
+		// from the corner of their bounds nearest to the camera. 0 always draws
+		// the full resolution meshes.
+		void setLevelOfDetailError(float pixels) { m_levelOfDetailError = pixels; }
+
 	private:
+		// Vertices and triangles of one mesh that survived hierarchical culling
+		struct DrawRange {
+			int firstVertex;
+			int vertexCount;
+			int firstIndex;
+			int indexCount;
+			int material;	// Index into m_shadingMaterials
+			bool level;		// The indices are in m_levelIndices rather than m_indices
+		};
+
 		// Initial data structure of scanline algorithm.
 		bool initialPolygonTableAndSideTable();
+		void setupTriangles(TriangleSetup &setup, int first, int last);
+		void collectDrawRanges();
+		void collectDrawRanges(const Node &node, bool inside);
+		unsigned char boundsOutcode(const QVector3D &min, const QVector3D &max, bool &inside);
+		float pixelsPerUnit(const QVector3D &min, const QVector3D &max) const;
+		void transformVertices(int first, int vertexCount);
 		QVector3D getVertexFromBuffer(int index);
+		QVector3D getProjectedVertex(int index);
+		QVector4D getClipVertex(int index);
+		QVector3D clipToWindow(const QVector4D &v);
+		bool cullPolygon(TriangleSetup &setup, int a, int b, int c);
+		int clipPolygon(int a, int b, int c, QVector3D *polygon, QVector3D *weights);
 		QVector3D getNormalFromBuffer(int index);
-		bool addPolygon(const QVector3D &a, const QVector3D &b, const QVector3D &c, float factor, int polygon_id);
-		bool addSides(const QVector3D &a, const QVector3D &b, const QVector3D &c, int polygon_id);
-		bool addSide(const QVector3D &a, const QVector3D &b, int polygon_id);
+		bool addPolygon(TriangleSetup &setup, const QVector3D *vertices, int vertexCount, float factor, int polygon_id);
+		int addShadingMaterial(const MaterialInfo *material);
+		void addShading(TriangleSetup &setup, Polygon &polygon, const QVector3D *vertices, const QVector3D *weights, int vertexCount,
+			const unsigned int *triangle, int material, bool textured);
+		bool addSides(TriangleSetup &setup, const QVector3D *vertices, int vertexCount, int polygon_id, unsigned int first_side_id);
+		bool addSide(TriangleSetup &setup, const QVector3D &a, const QVector3D &b, int polygon_id, unsigned int side_id);
+		void bucketSideTable();
+		void orderPendingSidesByRank();
+		void sortSideTable();
+		void sortSideTableCoherent();
+		const Side *sideRowBegin(int y) const { return m_sideTable.constData() + m_sideRowStart[y]; }
+		const Side *sideRowEnd(int y) const { return m_sideTable.constData() + m_sideRowStart[y + 1]; }
 
 		// Render
-		void scanlineRender(int scanline);
+		int threadCount() const;
+		void initialBands();
+		void seedBands();
+		template <bool collectStats> void renderBand(ScanlineBand &band);
+		template <bool collectStats> void scanlineRender(ScanlineBand &band, int scanline);
 		void initialFrameBuffer();
-		bool activateSides(int scanline);
-		void scan(int line);
+		bool activateSides(ScanlineBand &band, int scanline);
+		void reorderActiveSideList(ScanlineBand &band);
+		template <bool collectStats> void scan(ScanlineBand &band, int line);
+		template <bool collectStats> void scanAntiAliased(ScanlineBand &band, int line);
+		template <bool collectStats> int visiblePolygon(ScanlineBand &band, float x, int line);
+		void coverSpan(ScanlineBand &band, const EdgeRamp &left, const EdgeRamp &right, int y, QRgb color, int shading);
+		void addEdgeCoverage(ScanlineBand &band, const EdgeRamp &left, const EdgeRamp &right, int begin, int end,
+			int y, QRgb color, int shading);
+		void resolveEdgePixels(ScanlineBand &band, int y);
+		void togglePolygon(ScanlineBand &band, int polygon_id);
 
-		void updateActiveSideList();
+		void updateActiveSideList(ScanlineBand &band);
 		int findClosestPolygon(int x, int y);
 		void drawLine(int x1, int x2, int y, QRgb color);
+		void shadeLine(int x1, int x2, int y, QRgb color, const PolygonShading &shading);
+		void shadePixels(QRgb *pixels, int begin, int end, int y, QRgb color, const PolygonShading &shading);
+		void textureLine(QRgb *pixels, int begin, int end, int y, const PolygonShading &shading);
 
-		// save render result
-		void saveRenderResult();
+		// Double buffered frame images
+		void beginFrame();
+		void presentFrame();
 
 		int m_width;
 		int m_height;
 		QRgb m_backgroundColor;
 		float m_max_z;
+		int m_threadCount;
+		int m_cullMode;
+		bool m_statsEnabled;
+		bool m_coverageComplete;
+		bool m_fixedPointEdges;
+		bool m_temporalCoherence;
+		ShadingMode m_shadingMode;
+		bool m_antiAliasing;
+		float m_levelOfDetailError;
+		int m_bandHeight;
 
 		// Data structure of scanline algorithm.
 		QVector<Polygon> m_polygonTable;
-		QVector<QVector<Side>> m_sideTable;
-		QVector<Side> m_activeSideList;
-		QVector<QRgb> m_frame_buffer;
+		QVector<PolygonShading> m_polygonShading;
+		QVector<ShadingMaterial> m_shadingMaterials;
+
+		// Every side in one array, bucketed by the scanline it starts on:
+		// row y is m_sideTable[m_sideRowStart[y]] up to m_sideRowStart[y + 1].
+		// Sides are collected in m_pendingSides first and bucketed once.
+		QVector<Side> m_sideTable;
+		QVector<int> m_sideRowStart;
+		QVector<int> m_sideRowFill;
+		QVector<Side> m_pendingSides;
+		QVector<int> m_pendingSideRows;
+
+		// Triangle setup, see initialPolygonTableAndSideTable()
+		QVector<TriangleSetup> m_setupChunks;
+		QVector<int> m_drawRangeStart;	// First triangle of every draw range, and the total after the last
+
+		// Temporal coherence: m_sideRank holds, by side_id, the position a side
+		// had in the last frame's sorted side table, or -1. m_sideOrder is the
+		// order pending sides are bucketed in, ranked sides first.
+		QVector<int> m_sideRank;
+		QVector<int> m_rankSlots;
+		QVector<int> m_sideOrder;
+
+		QVector<ScanlineBand> m_bands;
+
+		// By OpenMP thread, as large as the polygon table. Kept per thread
+		// rather than per band, there are several bands for every thread.
+		QVector<QVector<int> > m_threadPolygonSlots;
+		QVector<QVector<int> > m_threadActivePolygons;
+
+		// The frame being rendered is m_frameImages[m_backImage], m_result is
+		// the other one once a frame has been presented.
+		QImage m_frameImages[2];
+		int m_backImage;
+		QRgb *m_frameBits;
+		int m_frameStride;	// In pixels
 
 		// Vertex data.
 		QVector<float> m_vertices;
 		QVector<float> m_normals;
 		QVector<unsigned int> m_indices;
+		QVector<unsigned int> m_levelIndices;
+		QVector<float> m_textureUV;
+		QSharedPointer<Node> m_rootNode;
+
+		QVector<DrawRange> m_drawRanges;
+		QSet<const Mesh *> m_collectedMeshes;
+
+		// Window coordinates of every vertex, projected once per frame.
+		QVector<float> m_screenX;
+		QVector<float> m_screenY;
+		QVector<float> m_screenZ;
+		QVector<unsigned char> m_outcodes;	// Frustum planes each vertex is outside of
+		QMatrix4x4 m_mvp;
 
 		// Matrics for render.
 		QVector3D m_camera_pos;
@@ -90,5 +417,6 @@ namespace SpanningScanline {
 		QRect m_viewport;
 
 		QImage m_result;
+		RenderStats m_stats;
 	};
 }
\ No newline at end of file
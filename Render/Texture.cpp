@@ -0,0 +1,120 @@
+#include "Texture.h"
+
+#include <QFileInfo>
+#include <QHash>
+#include <QMutex>
+#include <QMutexLocker>
+
+#include <algorithm>
+
+using SpanningScanline::Texture;
+
+namespace {
+	// The power of two closest to size, at most Texture::kMaxSize
+	int powerOfTwoSize(int size)
+	{
+		int p = 1;
+		while (p * 2 <= size && p < Texture::kMaxSize) {
+			p *= 2;
+		}
+
+		if (p < Texture::kMaxSize && size - p > p * 2 - size) {
+			p *= 2;
+		}
+
+		return p;
+	}
+}
+
+QSharedPointer<Texture> Texture::load(const QString &filePath)
+{
+	// Only weak references, a texture is freed with the last material using it
+	static QMutex mutex;
+	static QHash<QString, QWeakPointer<Texture> > cache;
+
+	const QString key = QFileInfo(filePath).canonicalFilePath();
+	if (key.isEmpty()) {
+		qWarning("Texture %s not found", qPrintable(filePath));
+		return QSharedPointer<Texture>();
+	}
+
+	QMutexLocker locker(&mutex);
+
+	QSharedPointer<Texture> texture = cache.value(key).toStrongRef();
+	if (texture) {
+		return texture;
+	}
+
+	const QImage image(key);
+	if (image.isNull()) {
+		qWarning("Cannot read texture %s", qPrintable(key));
+		return QSharedPointer<Texture>();
+	}
+
+	texture.reset(new Texture(image));
+	cache.insert(key, texture);
+
+	return texture;
+}
+
+Texture::Texture(const QImage &image)
+{
+	// Texture coordinates run up, image rows down
+	QImage level = image.convertToFormat(QImage::Format_RGB32).mirrored().scaled(
+		powerOfTwoSize(image.width()), powerOfTwoSize(image.height()), Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+
+	addLevel(level);
+
+	while (level.width() > 1 || level.height() > 1) {
+		const int width = std::max(1, level.width() / 2);
+		const int height = std::max(1, level.height() / 2);
+
+		// Box filter, a level 1 texel wide only averages along the other axis
+		const int nextX = level.width() > 1 ? 1 : 0;
+		const int nextY = level.height() > 1 ? 1 : 0;
+
+		QImage next(width, height, QImage::Format_RGB32);
+
+		for (int y = 0; y < height; y++) {
+			const QRgb *top = reinterpret_cast<const QRgb *>(level.constScanLine(y * 2));
+			const QRgb *bottom = reinterpret_cast<const QRgb *>(level.constScanLine(y * 2 + nextY));
+			QRgb *row = reinterpret_cast<QRgb *>(next.scanLine(y));
+
+			for (int x = 0; x < width; x++) {
+				const QRgb a = top[x * 2], b = top[x * 2 + nextX];
+				const QRgb c = bottom[x * 2], d = bottom[x * 2 + nextX];
+
+				row[x] = qRgb((qRed(a) + qRed(b) + qRed(c) + qRed(d) + 2) / 4,
+					(qGreen(a) + qGreen(b) + qGreen(c) + qGreen(d) + 2) / 4,
+					(qBlue(a) + qBlue(b) + qBlue(c) + qBlue(d) + 2) / 4);
+			}
+		}
+
+		level = next;
+		addLevel(level);
+	}
+}
+
+void Texture::addLevel(const QImage &image)
+{
+	Level level;
+	level.width = image.width();
+	level.height = image.height();
+	level.tilesPerRow = (level.width + 3) / 4;
+
+	// Levels smaller than a tile leave the rest of it unused
+	const int tileRows = (level.height + 3) / 4;
+	level.texels.resize(level.tilesPerRow * tileRows * 16);
+
+	QRgb *texels = level.texels.data();
+
+	for (int y = 0; y < level.height; y++) {
+		const QRgb *row = reinterpret_cast<const QRgb *>(image.constScanLine(y));
+
+		for (int x = 0; x < level.width; x++) {
+			texels[(((y >> 2) * level.tilesPerRow + (x >> 2)) << 4) | ((y & 3) << 2) | (x & 3)] = row[x];
+		}
+	}
+
+	m_levels.push_back(level);
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <QVector>
+#include <QImage>
+#include <QString>
+#include <QSharedPointer>
+
+namespace SpanningScanline {
+	// A texture and its whole mip chain, built once when the texture is
+	// loaded. Every level is stored in tiles of 4x4 texels, one 64 byte cache
+	// line each, so a span stepping through the texture in any direction
+	// stays within a few cache lines. Level 0 is scaled to powers of two at
+	// load time, texture coordinates then repeat with a mask.
+	class Texture
+	{
+	public:
+		// Textures larger than this are scaled down when they are loaded
+		static const int kMaxSize = 4096;
+
+		// Loads the file on first use and shares it with everyone asking for
+		// the same file afterwards. Null if the file cannot be read.
+		static QSharedPointer<Texture> load(const QString &filePath);
+
+		explicit Texture(const QImage &image);
+
+		int levelCount() const { return m_levels.size(); }
+		int width(int level) const { return m_levels[level].width; }
+		int height(int level) const { return m_levels[level].height; }
+
+		// x and y are wrapped to the level's size
+		QRgb texel(int level, int x, int y) const
+		{
+			const Level &l = m_levels[level];
+			x &= l.width - 1;
+			y &= l.height - 1;
+
+			return l.texels[(((y >> 2) * l.tilesPerRow + (x >> 2)) << 4) | ((y & 3) << 2) | (x & 3)];
+		}
+
+	private:
+		struct Level {
+			int width;
+			int height;
+			int tilesPerRow;
+			QVector<QRgb> texels;
+		};
+
+		void addLevel(const QImage &image);
+
+		QVector<Level> m_levels;
+	};
+}
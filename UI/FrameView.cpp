@@ -0,0 +1,36 @@
+#include "FrameView.h"
+#include <QPainter>
+#include <QPaintEvent>
+
+using SpanningScanline::FrameView;
+
+FrameView::FrameView(QWidget *parent)
+	: QWidget(parent)
+{
+	// Every pixel is painted from the frame, no need to clear first
+	setAttribute(Qt::WA_OpaquePaintEvent);
+}
+
+void FrameView::setFrame(const QImage &frame)
+{
+	m_frame = frame;
+	update();
+}
+
+QSize FrameView::sizeHint() const
+{
+	return m_frame.isNull() ? QWidget::sizeHint() : m_frame.size();
+}
+
+void FrameView::paintEvent(QPaintEvent *event)
+{
+	QPainter painter(this);
+
+	if (m_frame.isNull()) {
+		painter.fillRect(event->rect(), palette().color(QPalette::Base));
+		return;
+	}
+
+	// Unscaled when the widget has the frame's size, the usual case
+	painter.drawImage(rect(), m_frame);
+}
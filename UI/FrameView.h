@@ -0,0 +1,25 @@
+#pragma once
+
+#include <QWidget>
+#include <QImage>
+
+namespace SpanningScanline {
+	// Paints the last rendered frame as it is. The image is only shared, not
+	// converted to a QPixmap, so showing a frame costs a single blit.
+	class FrameView : public QWidget
+	{
+	public:
+		FrameView(QWidget *parent = Q_NULLPTR);
+
+		void setFrame(const QImage &frame);
+		const QImage &frame() const { return m_frame; }
+
+		QSize sizeHint() const;
+
+	protected:
+		void paintEvent(QPaintEvent *event);
+
+	private:
+		QImage m_frame;
+	};
+}
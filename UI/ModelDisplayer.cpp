@@ -6,13 +6,13 @@ using SpanningScanline::ModelDisplayer;
 
 ModelDisplayer::ModelDisplayer(QWidget *parent)
 	: QMainWindow(parent),
-	imageLabel(new QLabel),
+	frameView(new FrameView),
 	scrollArea(new QScrollArea),
 	scaleFactor(1),
 	loader(false),
 	m_width(600),
 	m_height(600),
-	render(qRgb(0, 0, 0)),
+	m_renderWorker(new RenderWorker(qRgb(0, 0, 0))),
 	m_camera_distance(5.f),
 	m_horizontalAngle(0.f),
 	m_verticalAngle(0.f),
@@ -21,12 +21,11 @@ ModelDisplayer::ModelDisplayer(QWidget *parent)
 {
 	ui.setupUi(this);
 
-	imageLabel->setBackgroundRole(QPalette::Base);
-	imageLabel->setSizePolicy(QSizePolicy::Ignored, QSizePolicy::Ignored);
-	imageLabel->setScaledContents(true);
+	frameView->setBackgroundRole(QPalette::Base);
+	frameView->setSizePolicy(QSizePolicy::Ignored, QSizePolicy::Ignored);
 
 	scrollArea->setBackgroundRole(QPalette::Dark);
-	scrollArea->setWidget(imageLabel);
+	scrollArea->setWidget(frameView);
 	scrollArea->setVisible(false);
 	setCentralWidget(scrollArea);
 
@@ -38,8 +37,24 @@ ModelDisplayer::ModelDisplayer(QWidget *parent)
 	typeFilter += loader.getSupportedTypes();
 	typeFilter += ");;All Files (*)";
 
+	// Frames are rendered off the GUI thread and handed back through a queued signal
+	m_renderWorker->moveToThread(&m_renderThread);
+	connect(&m_renderThread, &QThread::finished, m_renderWorker, &QObject::deleteLater);
+	connect(m_renderWorker, &RenderWorker::frameReady, this, &ModelDisplayer::frameRendered);
+	m_renderThread.start();
+
+	m_refineTimer.setSingleShot(true);
+	m_refineTimer.setInterval(200);
+	connect(&m_refineTimer, &QTimer::timeout, this, &ModelDisplayer::refineDisplay);
+
 	updateCamera();
-	render.setWindowSize(m_width, m_height);
+	m_renderWorker->submitWindowSize(m_width, m_height);
+}
+
+ModelDisplayer::~ModelDisplayer()
+{
+	m_renderThread.quit();
+	m_renderThread.wait();
 }
 
 void SpanningScanline::ModelDisplayer::about()
@@ -56,18 +71,40 @@ void ModelDisplayer::createActions()
 	QMenu *fileMenu = menuBar()->addMenu(tr("&File"));
 	fileMenu->addAction(tr("&Open..."), this, &ModelDisplayer::open);
 
+	QMenu *viewMenu = menuBar()->addMenu(tr("&View"));
+	QActionGroup *shadingGroup = new QActionGroup(this);
+	const QPair<QString, ModelRender::ShadingMode> shadingModes[] = {
+		qMakePair(tr("&Flat Shading"), ModelRender::ShadeFlat),
+		qMakePair(tr("&Gouraud Shading"), ModelRender::ShadeGouraud),
+		qMakePair(tr("&Phong Shading"), ModelRender::ShadePhong)
+	};
+	for (const auto &mode : shadingModes) {
+		QAction *action = viewMenu->addAction(mode.first);
+		action->setCheckable(true);
+		action->setChecked(mode.second == ModelRender::ShadeFlat);
+		action->setData(int(mode.second));
+		shadingGroup->addAction(action);
+	}
+	connect(shadingGroup, &QActionGroup::triggered, this, &ModelDisplayer::setShadingMode);
+
 	QMenu *helpMenu = menuBar()->addMenu(tr("&Help"));
 	helpMenu->addAction(tr("&About"), this, &ModelDisplayer::about);
 }
 
+void ModelDisplayer::setShadingMode(QAction *action)
+{
+	m_renderWorker->submitShadingMode(ModelRender::ShadingMode(action->data().toInt()));
+	refineDisplay();
+}
+
 void ModelDisplayer::updateActions()
 {
 }
 
 void ModelDisplayer::setImage(const QImage & newImage)
 {
-	image = newImage;
-	imageLabel->setPixmap(QPixmap::fromImage(image));
+	// Shares the renderer's image, see ModelRender::getRenderResult()
+	frameView->setFrame(newImage);
 	scaleFactor = 1.0;
 
 	scrollArea->setVisible(true);
@@ -83,6 +120,7 @@ void ModelDisplayer::open() {
 
 	if (!fileName.isEmpty()) {
 		loader = ModelLoader(false);
+		loader.setImportProfile(ModelLoader::ImportRenderOnly);
 		bool loaded = loader.load(fileName, ModelLoader::PathType::AbsolutePath);
 
 		if (loaded) {
@@ -91,10 +129,17 @@ void ModelDisplayer::open() {
 			QVector<unsigned int> *indices;
 
 			loader.getBufferData(&vertices, &normals, &indices);
-			render.setBufferData(*vertices, *normals, *indices);
+
+			// The renderer only maps the first channel, with two components
+			QVector<QVector<float> > *textureUV;
+			loader.getTextureData(&textureUV, 0, 0);
+			const bool hasUV = loader.numUVChannels() > 0 && loader.numUVComponents(0) == 2;
+
+			m_renderWorker->submitScene(*vertices, *normals, *indices, loader.getLevelIndices(),
+				hasUV ? textureUV->first() : QVector<float>(), loader.getNodeData());
 			
 			resetCamera();
-			updateDisplay();
+			refineDisplay();
 		}
 	}
 }
@@ -208,21 +253,28 @@ void SpanningScanline::ModelDisplayer::updateCamera()
 	rot.rotate(m_verticalAngle, QVector3D(1.f, 0.f, 0.f));
 	QVector4D camera_pos(0, 0, m_camera_distance, 1);
 
-	QVector3D camera_pos_rotated = (rot * camera_pos).toVector3D();
-	render.setCameraPos(camera_pos_rotated);
+	m_cameraPos = (rot * camera_pos).toVector3D();
 }
 
 void SpanningScanline::ModelDisplayer::updateDisplay()
 {
-	QTime time;
-	time.start();
+	// Returns at once, frameRendered() shows the result. While the camera keeps
+	// moving the frames may be rendered at reduced resolution.
+	m_renderWorker->submitCamera(m_cameraPos, RenderWorker::Preview);
+	m_refineTimer.start();
+}
 
-	if (render.render()) {
-		int delta_time = time.elapsed();
-		printf("Using %d ms\n", delta_time);
+void SpanningScanline::ModelDisplayer::refineDisplay()
+{
+	m_refineTimer.stop();
+	m_renderWorker->submitCamera(m_cameraPos, RenderWorker::Full);
+}
 
-		setImage(render.getRenderResult());
-	}
+void SpanningScanline::ModelDisplayer::frameRendered(const QImage &image, int renderTime)
+{
+	printf("Using %d ms\n", renderTime);
+
+	setImage(image);
 }
 
 void SpanningScanline::ModelDisplayer::resetCamera()
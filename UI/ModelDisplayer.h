@@ -8,9 +8,10 @@
 
 #include "Loader/ModelLoader.h"
 #include "Render/ModelRender.h"
+#include "RenderWorker.h"
+#include "FrameView.h"
 
 class QAction;
-class QLabel;
 class QMenu;
 class QScrollArea;
 class QScrollBar;
@@ -27,10 +28,14 @@ namespace SpanningScanline {
 
 	public:
 		ModelDisplayer(QWidget *parent = Q_NULLPTR);
+		~ModelDisplayer();
 
 	private slots:
 		void open();
 		void about();
+		void frameRendered(const QImage &image, int renderTime);
+		void refineDisplay();
+		void setShadingMode(QAction *action);
 
 	private:
 		void createActions();
@@ -49,8 +54,7 @@ namespace SpanningScanline {
 
 		void resetCamera();
 
-		QImage image;
-		QLabel *imageLabel;
+		FrameView *frameView;
 		QScrollArea *scrollArea;
 		double scaleFactor;
 
@@ -62,7 +66,10 @@ namespace SpanningScanline {
 
 		// Render
 		int m_width, m_height;
-		ModelRender render;
+		QThread m_renderThread;
+		RenderWorker *m_renderWorker;
+		QVector3D m_cameraPos;
+		QTimer m_refineTimer;	// Renders at full resolution once interaction stops
 
 		// Interaction
 		float m_camera_distance;
@@ -0,0 +1,189 @@
+#include "RenderWorker.h"
+#include <QElapsedTimer>
+#include <QMutexLocker>
+
+using SpanningScanline::RenderWorker;
+
+namespace {
+	const int kMaxPreviewDivisor = 4;
+}
+
+RenderWorker::RenderWorker(QRgb backgroundColor, QObject *parent)
+	: QObject(parent),
+	m_render(backgroundColor),
+	m_frameWidth(0),
+	m_frameHeight(0),
+	m_renderDivisor(0),
+	m_previewDivisor(1),
+	m_renderScheduled(false),
+	m_hasScene(false),
+	m_hasWindowSize(false),
+	m_width(0),
+	m_height(0),
+	m_hasShadingMode(false),
+	m_shadingMode(ModelRender::ShadeFlat),
+	m_hasCamera(false),
+	m_quality(Full),
+	m_frameBudget(33)
+{
+	// Orbiting moves the camera a little per frame, so last frame's side
+	// order is nearly right
+	m_render.setTemporalCoherence(true);
+}
+
+void RenderWorker::submitScene(const QVector<float> &vertices, const QVector<float> &normals,
+	const QVector<unsigned int> &indices, const QVector<unsigned int> &levelIndices,
+	const QVector<float> &textureUV, const QSharedPointer<Node> &rootNode)
+{
+	QMutexLocker locker(&m_mutex);
+
+	m_vertices = vertices;
+	m_normals = normals;
+	m_indices = indices;
+	m_levelIndices = levelIndices;
+	m_textureUV = textureUV;
+	m_rootNode = rootNode;
+	m_hasScene = true;
+}
+
+void RenderWorker::submitWindowSize(int width, int height)
+{
+	QMutexLocker locker(&m_mutex);
+
+	m_width = width;
+	m_height = height;
+	m_hasWindowSize = true;
+}
+
+void RenderWorker::submitShadingMode(ModelRender::ShadingMode mode)
+{
+	QMutexLocker locker(&m_mutex);
+
+	m_shadingMode = mode;
+	m_hasShadingMode = true;
+}
+
+void RenderWorker::submitCamera(const QVector3D &pos, FrameQuality quality)
+{
+	QMutexLocker locker(&m_mutex);
+
+	// Overwrites any camera the worker did not get to yet
+	m_cameraPos = pos;
+	m_quality = quality;
+	m_hasCamera = true;
+
+	scheduleRender();
+}
+
+void RenderWorker::setFrameBudget(int ms)
+{
+	QMutexLocker locker(&m_mutex);
+
+	m_frameBudget = ms;
+}
+
+void RenderWorker::scheduleRender()
+{
+	// At most one renderPending() is queued, it picks up whatever is newest
+	if (!m_renderScheduled) {
+		m_renderScheduled = true;
+		QMetaObject::invokeMethod(this, "renderPending", Qt::QueuedConnection);
+	}
+}
+
+void RenderWorker::renderPending()
+{
+	bool changed = false;
+	FrameQuality quality;
+	int frameBudget;
+
+	{
+		QMutexLocker locker(&m_mutex);
+
+		m_renderScheduled = false;
+
+		if (m_hasScene) {
+			m_render.setBufferData(m_vertices, m_normals, m_indices);
+			m_render.setLevelIndices(m_levelIndices);
+			m_render.setTextureCoordinates(m_textureUV);
+			m_render.setNodeData(m_rootNode);
+
+			m_vertices.clear();
+			m_normals.clear();
+			m_indices.clear();
+			m_levelIndices.clear();
+			m_textureUV.clear();
+			m_rootNode.clear();
+			m_hasScene = false;
+			changed = true;
+		}
+
+		if (m_hasWindowSize) {
+			m_frameWidth = m_width;
+			m_frameHeight = m_height;
+			m_renderDivisor = 0;
+			m_hasWindowSize = false;
+			changed = true;
+		}
+
+		if (m_hasShadingMode) {
+			m_render.setShadingMode(m_shadingMode);
+			m_hasShadingMode = false;
+			changed = true;
+		}
+
+		if (m_hasCamera) {
+			m_render.setCameraPos(m_cameraPos);
+			changed = changed || m_cameraPos != m_renderedCameraPos;
+			m_renderedCameraPos = m_cameraPos;
+			m_hasCamera = false;
+		}
+
+		quality = m_quality;
+		frameBudget = m_frameBudget;
+	}
+
+	const int divisor = quality == Preview ? m_previewDivisor : 1;
+
+	// The last preview was already rendered at full resolution
+	if (!changed && divisor == m_renderDivisor) {
+		return;
+	}
+
+	if (divisor != m_renderDivisor) {
+		m_render.setWindowSize(qMax(1, m_frameWidth / divisor), qMax(1, m_frameHeight / divisor));
+		m_renderDivisor = divisor;
+	}
+
+	QElapsedTimer timer;
+	timer.start();
+
+	if (!m_render.render()) {
+		return;
+	}
+
+	const int renderTime = int(timer.elapsed());
+
+	if (quality == Preview) {
+		adaptPreviewDivisor(renderTime, frameBudget);
+	}
+
+	QImage image = m_render.getRenderResult();
+	if (divisor > 1) {
+		image = image.scaled(m_frameWidth, m_frameHeight, Qt::IgnoreAspectRatio, Qt::FastTransformation);
+	}
+
+	emit frameReady(image, renderTime);
+}
+
+void RenderWorker::adaptPreviewDivisor(int renderTime, int frameBudget)
+{
+	// Frame time scales roughly with the pixel count, so halving the
+	// resolution cuts it to about a quarter.
+	if (renderTime > frameBudget && m_previewDivisor < kMaxPreviewDivisor) {
+		m_previewDivisor *= 2;
+	}
+	else if (m_previewDivisor > 1 && renderTime * 4 < frameBudget) {
+		m_previewDivisor /= 2;
+	}
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <QObject>
+#include <QMutex>
+#include <QImage>
+#include <QVector3D>
+#include <QSharedPointer>
+
+#include "Render/ModelRender.h"
+
+namespace SpanningScanline {
+	struct Node;
+
+	// Owns a ModelRender and runs it on whatever thread the worker is moved to.
+	// The submit functions may be called from any thread. Scene, window size and
+	// shading mode are applied with the next frame, and a burst of camera
+	// updates renders only the newest camera.
+	//
+	// Preview frames are rendered at 1/2 or 1/4 of the window size, whichever
+	// keeps them within the frame budget, and upscaled before being handed out.
+	class RenderWorker : public QObject
+	{
+		Q_OBJECT
+
+	public:
+		enum FrameQuality {
+			Preview,
+			Full
+		};
+
+		RenderWorker(QRgb backgroundColor, QObject *parent = Q_NULLPTR);
+
+		void submitScene(const QVector<float> &vertices, const QVector<float> &normals,
+			const QVector<unsigned int> &indices, const QVector<unsigned int> &levelIndices,
+			const QVector<float> &textureUV, const QSharedPointer<Node> &rootNode);
+		void submitWindowSize(int width, int height);
+		void submitCamera(const QVector3D &pos, FrameQuality quality);  // Requests a frame
+		void submitShadingMode(ModelRender::ShadingMode mode);
+
+		void setFrameBudget(int ms);
+
+	signals:
+		void frameReady(const QImage &image, int renderTime);
+
+	private slots:
+		void renderPending();
+
+	private:
+		void scheduleRender();
+		void adaptPreviewDivisor(int renderTime, int frameBudget);
+
+		ModelRender m_render;
+
+		// Only touched by the worker thread
+		int m_frameWidth, m_frameHeight;
+		int m_renderDivisor;
+		int m_previewDivisor;
+		QVector3D m_renderedCameraPos;
+
+		// Everything below is guarded by m_mutex
+		QMutex m_mutex;
+		bool m_renderScheduled;
+
+		bool m_hasScene;
+		QVector<float> m_vertices;
+		QVector<float> m_normals;
+		QVector<unsigned int> m_indices;
+		QVector<unsigned int> m_levelIndices;
+		QVector<float> m_textureUV;
+		QSharedPointer<Node> m_rootNode;
+
+		bool m_hasWindowSize;
+		int m_width, m_height;
+
+		bool m_hasShadingMode;
+		ModelRender::ShadingMode m_shadingMode;
+
+		bool m_hasCamera;
+		QVector3D m_cameraPos;
+		FrameQuality m_quality;
+
+		int m_frameBudget;
+	};
+}